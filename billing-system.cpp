@@ -8,14 +8,47 @@
 #include <ctime>
 #include <cstdio>
 #include <cstdlib>
+#include <cmath>
 #include <limits>
 #include <cctype>
+#include <unordered_map>
+#include <unordered_set>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <charconv>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <deque>
 
 #ifdef _WIN32
 #include <direct.h>
+#include <io.h>
+#include <fcntl.h>
+#include <sys/locking.h>
+#include <sys/stat.h>
+#include <sys/types.h>
 #else
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
 #endif
 
 using namespace std;
@@ -24,6 +57,21 @@ static const string CUSTOMERS_FILE = "customers.csv";
 static const string ITEMS_FILE = "items.csv";
 static const string INVOICES_META_FILE = "invoices_meta.csv";
 static const string INVOICES_FOLDER = "invoices";
+static const string INVOICE_LEDGER_FILE = "invoices_ledger.bin";
+static const string INVOICE_LEDGER_INDEX_FILE = "invoices_ledger.idx";
+static const string DOCUMENT_INDEX_FILE = INVOICES_FOLDER + "/documents.idx";
+static const uint64_t DOCUMENT_SEGMENT_MAX = 256ULL << 20;
+static const string SNAPSHOT_FILE = "billing.snapshot";
+static const string ROLLUP_FILE = "sales_rollups.bin";
+static const string ACCOUNTS_FILE = "customer_accounts.bin";
+static const string CHANGE_LOG_FILE = "changes.log";
+static const string SUBSCRIPTIONS_FILE = "subscriptions.csv";
+static const string BILLING_RUNS_FILE = "billing_runs.csv";
+static const string TAX_RULES_FILE = "tax_rules.csv";
+static const string ID_COUNTERS_FILE = "id_counters.bin";
+static const int64_t COMPACT_LOG_THRESHOLD = 4 << 20;
+static const size_t SEARCH_RESULT_LIMIT = 50;
+static const size_t LIST_PAGE_SIZE = 25;
 
 string now_datetime() {
     time_t t = time(nullptr);
@@ -41,6 +89,36 @@ string now_date() {
     return string(buf);
 }
 
+int date_key(const string& s) {
+    if (s.size() != 10 || s[4] != '-' || s[7] != '-') return -1;
+    int key = 0;
+    for (size_t i = 0; i < s.size(); ++i) {
+        if (i == 4 || i == 7) continue;
+        if (!isdigit((unsigned char)s[i])) return -1;
+        key = key * 10 + (s[i] - '0');
+    }
+    return key;
+}
+
+string date_from_key(int key) {
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%04d-%02d-%02d", key / 10000, (key / 100) % 100, key % 100);
+    return string(buf);
+}
+
+void make_directory(const string& path) {
+#ifdef _WIN32
+    _mkdir(path.c_str());
+#else
+    mkdir(path.c_str(), 0755);
+#endif
+}
+
+bool file_exists(const string& path) {
+    ifstream in(path.c_str(), ios::binary);
+    return (bool)in;
+}
+
 string trim(const string& s) {
     size_t i = 0;
     size_t j = s.size();
@@ -75,6 +153,9 @@ int input_int(const string& prompt, bool allowEmpty=false, int defaultVal=0) {
     }
 }
 
+// Largest magnitude accepted for a typed amount, quantity or percentage.
+static const double INPUT_LIMIT = 1e12;
+
 double input_double(const string& prompt, bool allowEmpty=false, double defaultVal=0.0) {
     while (true) {
         string s = input_line(prompt);
@@ -87,6 +168,7 @@ double input_double(const string& prompt, bool allowEmpty=false, double defaultV
             size_t pos = 0;
             double v = stod(s, &pos);
             if (pos != s.size()) throw invalid_argument("extra");
+            if (!(fabs(v) <= INPUT_LIMIT)) { cout << "Number out of range. Try again.\n"; continue; }
             return v;
         } catch (...) {
             cout << "Invalid number. Try again.\n";
@@ -94,411 +176,5574 @@ double input_double(const string& prompt, bool allowEmpty=false, double defaultV
     }
 }
 
-int next_id_from_file(const string& file, int defaultStart) {
-    ifstream in(file.c_str());
-    if (!in) return defaultStart;
-    string line;
-    int maxId = defaultStart - 1;
-    while (getline(in, line)) {
-        if (line.empty()) continue;
-        stringstream ss(line);
-        string idStr;
-        if (getline(ss, idStr, ',')) {
-            try {
-                int id = stoi(idStr);
-                if (id > maxId) maxId = id;
-            } catch (...) {}
-        }
-    }
-    return maxId + 1;
-}
+// Hot-path instrumentation: per-operation latency histograms with log2
+// nanosecond buckets, plus I/O and scan counters. Everything is relaxed
+// atomics; building with -DBILLING_NO_STATS compiles the macros to nothing.
+enum StatOp {
+    OP_LOAD_ALL, OP_SNAPSHOT_LOAD, OP_SNAPSHOT_SAVE, OP_LEDGER_LOAD,
+    OP_FIND_CUSTOMER, OP_FIND_ITEM, OP_SEARCH_CUSTOMERS, OP_SEARCH_ITEMS,
+    OP_SAVE_INVOICE, OP_RENDER_INVOICE, OP_WRITE_DOCUMENT, OP_LEDGER_APPEND, OP_META_APPEND,
+    OP_CHANGE_LOG_APPEND, OP_COMPACT, OP_SALES_REPORT, OP_READ_DOCUMENT, OP_GROUP_COMMIT,
+    OP_SALES_ANALYTICS, OP_COUNT
+};
 
-struct Customer {
-    int id;
-    string name;
-    string address;
-    string email;
-    string phone;
-    static Customer from_csv(const string& line) {
-        Customer c;
-        stringstream ss(line);
-        string field;
-        getline(ss, field, ','); c.id = stoi(field);
-        getline(ss, c.name, ',');
-        getline(ss, c.address, ',');
-        getline(ss, c.email, ',');
-        getline(ss, c.phone, ',');
-        return c;
+static const char* const STAT_OP_NAMES[OP_COUNT] = {
+    "load_all", "snapshot_load", "snapshot_save", "ledger_load",
+    "find_customer", "find_item", "search_customers", "search_items",
+    "save_invoice", "render_invoice", "write_document", "ledger_append", "meta_append",
+    "change_log_append", "compact", "sales_report", "read_document", "group_commit",
+    "sales_analytics"
+};
+
+enum StatCounter { CTR_FILES_OPENED, CTR_BYTES_READ, CTR_BYTES_WRITTEN, CTR_RECORDS_SCANNED, CTR_FSYNCS, CTR_COUNT };
+
+static const char* const STAT_COUNTER_NAMES[CTR_COUNT] = { "files_opened", "bytes_read", "bytes_written", "records_scanned", "fsyncs" };
+
+#ifndef BILLING_NO_STATS
+struct LatencyHistogram {
+    atomic<uint64_t> buckets[64];
+    atomic<uint64_t> count;
+    atomic<uint64_t> sum;
+    atomic<uint64_t> max;
+    // weight > 1 stands for that many calls, of which this one was timed.
+    void record(uint64_t ns, uint64_t weight = 1) {
+        int b = 0;
+        while (b < 63 && (ns >> b) != 0) ++b;
+        buckets[b > 63 ? 63 : b].fetch_add(weight, memory_order_relaxed);
+        count.fetch_add(weight, memory_order_relaxed);
+        sum.fetch_add(ns * weight, memory_order_relaxed);
+        uint64_t m = max.load(memory_order_relaxed);
+        while (ns > m && !max.compare_exchange_weak(m, ns, memory_order_relaxed)) {}
     }
-    string to_csv() const {
-        stringstream ss;
-        ss << id << "," << name << "," << address << "," << email << "," << phone;
-        return ss.str();
+    // Upper bound of the bucket holding the p-th percentile, capped at the observed max.
+    uint64_t percentile(int p) const {
+        uint64_t n = count.load(memory_order_relaxed);
+        uint64_t top = max.load(memory_order_relaxed);
+        if (n == 0) return 0;
+        uint64_t rank = (n * p + 99) / 100;
+        uint64_t seen = 0;
+        for (int b = 0; b < 63; ++b) {
+            seen += buckets[b].load(memory_order_relaxed);
+            if (seen >= rank) return b == 0 ? 0 : min<uint64_t>(top, (1ULL << b) - 1);
+        }
+        return top;
     }
 };
 
-struct Item {
-    int id;
-    string code;
-    string description;
-    double unitPrice;
-    double taxPercent;
-    static Item from_csv(const string& line) {
-        Item it;
-        stringstream ss(line);
-        string field;
-        getline(ss, field, ','); it.id = stoi(field);
-        getline(ss, it.code, ',');
-        getline(ss, it.description, ',');
-        getline(ss, field, ','); it.unitPrice = stod(field);
-        getline(ss, field, ','); it.taxPercent = stod(field);
-        return it;
+struct Stats {
+    LatencyHistogram ops[OP_COUNT];
+    atomic<uint64_t> counters[CTR_COUNT];
+    Stats() { reset(); }
+    void reset() {
+        for (auto& h : ops) {
+            for (auto& b : h.buckets) b.store(0, memory_order_relaxed);
+            h.count.store(0, memory_order_relaxed);
+            h.sum.store(0, memory_order_relaxed);
+            h.max.store(0, memory_order_relaxed);
+        }
+        for (auto& c : counters) c.store(0, memory_order_relaxed);
     }
-    string to_csv() const {
-        stringstream ss;
-        ss << id << "," << code << "," << description << "," << fixed << setprecision(2) << unitPrice << "," << taxPercent;
-        return ss.str();
+    void add(StatCounter c, uint64_t n) { counters[c].fetch_add(n, memory_order_relaxed); }
+    void print(ostream& out) const {
+        ios::fmtflags flags = out.flags();
+        streamsize precision = out.precision();
+        out << left << setw(20) << "Operation" << right << setw(10) << "Count" << setw(12) << "Mean(us)" << setw(12) << "p50(us)" << setw(12) << "p99(us)" << setw(12) << "Max(us)" << "\n";
+        out << string(78, '-') << "\n";
+        for (int i = 0; i < OP_COUNT; ++i) {
+            const LatencyHistogram& h = ops[i];
+            uint64_t n = h.count.load(memory_order_relaxed);
+            if (n == 0) continue;
+            out << left << setw(20) << STAT_OP_NAMES[i] << right << setw(10) << n << fixed << setprecision(1)
+                << setw(12) << h.sum.load(memory_order_relaxed) / 1000.0 / n << setw(12) << h.percentile(50) / 1000.0
+                << setw(12) << h.percentile(99) / 1000.0 << setw(12) << h.max.load(memory_order_relaxed) / 1000.0 << "\n";
+        }
+        out << string(78, '-') << "\n";
+        for (int i = 0; i < CTR_COUNT; ++i) out << left << setw(20) << STAT_COUNTER_NAMES[i] << right << setw(10) << counters[i].load(memory_order_relaxed) << "\n";
+        out.flags(flags);
+        out.precision(precision);
+    }
+    // Prometheus text exposition format.
+    void dump(ostream& out) const {
+        for (int i = 0; i < CTR_COUNT; ++i) out << "billing_" << STAT_COUNTER_NAMES[i] << "_total " << counters[i].load(memory_order_relaxed) << "\n";
+        for (int i = 0; i < OP_COUNT; ++i) {
+            const LatencyHistogram& h = ops[i];
+            uint64_t cumulative = 0;
+            for (int b = 0; b < 63; ++b) {
+                uint64_t n = h.buckets[b].load(memory_order_relaxed);
+                cumulative += n;
+                if (n) out << "billing_op_latency_ns_bucket{op=\"" << STAT_OP_NAMES[i] << "\",le=\"" << (b == 0 ? 0 : (1ULL << b) - 1) << "\"} " << cumulative << "\n";
+            }
+            out << "billing_op_latency_ns_bucket{op=\"" << STAT_OP_NAMES[i] << "\",le=\"+Inf\"} " << h.count.load(memory_order_relaxed) << "\n";
+            out << "billing_op_latency_ns_sum{op=\"" << STAT_OP_NAMES[i] << "\"} " << h.sum.load(memory_order_relaxed) << "\n";
+            out << "billing_op_latency_ns_count{op=\"" << STAT_OP_NAMES[i] << "\"} " << h.count.load(memory_order_relaxed) << "\n";
+        }
     }
 };
 
-struct InvoiceLine {
-    int itemId;
-    string description;
-    double unitPrice;
-    double quantity;
-    double taxPercent;
-    double lineAmount() const { return unitPrice * quantity; }
-    double taxAmount() const { return lineAmount() * (taxPercent / 100.0); }
+static Stats g_stats;
+
+struct ScopedTimer {
+    StatOp op;
+    chrono::steady_clock::time_point start;
+    explicit ScopedTimer(StatOp o) : op(o), start(chrono::steady_clock::now()) {}
+    ~ScopedTimer() {
+        g_stats.ops[op].record((uint64_t)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+    }
 };
 
-struct Invoice {
-    int id;
-    int customerId;
-    string date;
-    string note;
-    vector<InvoiceLine> lines;
-    double discountPercent;
-    double shipping;
-    string to_txt(const Customer& c) const {
-        stringstream ss;
-        ss << left << setw(40) << "BILLING SYSTEM" << right << setw(30) << "INVOICE #" << id << "\n";
-        ss << left << setw(50) << "Date: " << date << "\n";
-        ss << left << setw(50) << "Customer: " << c.name << "\n";
-        ss << left << setw(50) << "Address: " << c.address << "\n";
-        ss << left << setw(50) << "Email: " << c.email << "\n";
-        ss << left << setw(50) << "Phone: " << c.phone << "\n\n";
-        ss << left << setw(6) << "No" << setw(8) << "Qty" << setw(10) << "Unit" << setw(40) << "Description" << setw(10) << "Tax%" << setw(14) << "LineTotal" << "\n";
-        ss << string(90, '-') << "\n";
-        double sub = 0;
-        double tax = 0;
-        for (size_t i = 0; i < lines.size(); ++i) {
-            const InvoiceLine& L = lines[i];
-            ss << left << setw(6) << i + 1 << setw(8) << L.quantity << setw(10) << fixed << setprecision(2) << L.unitPrice << setw(40) << L.description << setw(10) << L.taxPercent << setw(14) << fixed << setprecision(2) << L.lineAmount() << "\n";
-            sub += L.lineAmount();
-            tax += L.taxAmount();
-        }
-        ss << string(90, '-') << "\n";
-        ss << right << setw(70) << "Subtotal: " << setw(14) << fixed << setprecision(2) << sub << "\n";
-        ss << right << setw(70) << "Tax: " << setw(14) << fixed << setprecision(2) << tax << "\n";
-        double discount = (discountPercent / 100.0) * (sub + tax);
-        ss << right << setw(70) << "Discount (" << discountPercent << "%): " << setw(14) << fixed << setprecision(2) << -discount << "\n";
-        ss << right << setw(70) << "Shipping: " << setw(14) << fixed << setprecision(2) << shipping << "\n";
-        double total = sub + tax - discount + shipping;
-        ss << right << setw(70) << "TOTAL: " << setw(14) << fixed << setprecision(2) << total << "\n\n";
-        ss << "Note: " << note << "\n";
-        ss << "Generated: " << now_datetime() << "\n";
-        return ss.str();
+// For lookups that take tens of nanoseconds: each thread times one call in
+// STATS_SAMPLE_EVERY, with no shared writes for the others, and records it
+// weighted so counts and means still cover every call.
+static const uint32_t STATS_SAMPLE_EVERY = 64;
+
+struct SampledTimer {
+    StatOp op;
+    bool timed;
+    chrono::steady_clock::time_point start;
+    explicit SampledTimer(StatOp o) : op(o), timed(++tick() % STATS_SAMPLE_EVERY == 0) {
+        if (timed) start = chrono::steady_clock::now();
     }
-    string meta_csv() const {
-        stringstream ss;
-        ss << id << "," << customerId << "," << date << "," << fixed << setprecision(2) << discountPercent << "," << fixed << setprecision(2) << shipping;
-        return ss.str();
+    ~SampledTimer() {
+        if (timed) g_stats.ops[op].record((uint64_t)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count(), STATS_SAMPLE_EVERY);
+    }
+    static uint32_t& tick() {
+        thread_local uint32_t calls = 0;
+        return calls;
     }
 };
 
-struct BillingSystem {
-    vector<Customer> customers;
-    vector<Item> items;
-    vector<Invoice> invoices;
-    int nextCustomerId;
-    int nextItemId;
-    int nextInvoiceId;
-    BillingSystem() {
-        ensure_invoices_folder();
-        nextCustomerId = next_id_from_file(CUSTOMERS_FILE, 1001);
-        nextItemId = next_id_from_file(ITEMS_FILE, 5001);
-        nextInvoiceId = next_id_from_file(INVOICES_META_FILE, 9001);
-        load_all();
-    }
-    void ensure_invoices_folder() {
+#define STATS_CONCAT2(a, b) a##b
+#define STATS_CONCAT(a, b) STATS_CONCAT2(a, b)
+#define STATS_TIMER(op) ScopedTimer STATS_CONCAT(statsTimer, __LINE__)(op)
+#define STATS_SAMPLED_TIMER(op) SampledTimer STATS_CONCAT(statsTimer, __LINE__)(op)
+#define STATS_ADD(counter, n) g_stats.add(counter, (uint64_t)(n))
+#else
+#define STATS_TIMER(op) ((void)0)
+#define STATS_SAMPLED_TIMER(op) ((void)0)
+#define STATS_ADD(counter, n) ((void)0)
+#endif
+
+struct MappedFile {
+    const char* data = nullptr;
+    size_t size = 0;
 #ifdef _WIN32
-        _mkdir(INVOICES_FOLDER.c_str());
+    string buffer;
 #else
-        mkdir(INVOICES_FOLDER.c_str(), 0755);
+    void* mapping = nullptr;
 #endif
-    }
-    void load_all() {
-        customers.clear();
-        items.clear();
-        invoices.clear();
-        ifstream fc(CUSTOMERS_FILE.c_str());
-        string line;
-        while (getline(fc, line)) {
-            if (line.empty()) continue;
-            try { customers.push_back(Customer::from_csv(line)); } catch(...) {}
-        }
-        ifstream fi(ITEMS_FILE.c_str());
-        while (getline(fi, line)) {
-            if (line.empty()) continue;
-            try { items.push_back(Item::from_csv(line)); } catch(...) {}
-        }
-        ifstream fm(INVOICES_META_FILE.c_str());
-        while (getline(fm, line)) {
-            if (line.empty()) continue;
-            stringstream ss(line);
-            string idStr, customerStr, dateStr, discStr, shipStr;
-            getline(ss, idStr, ','); getline(ss, customerStr, ','); getline(ss, dateStr, ','); getline(ss, discStr, ','); getline(ss, shipStr, ',');
-            try {
-                Invoice inv;
-                inv.id = stoi(idStr);
-                inv.customerId = stoi(customerStr);
-                inv.date = dateStr;
-                inv.discountPercent = stod(discStr);
-                inv.shipping = stod(shipStr);
-                string invFile = INVOICES_FOLDER + "/invoice_" + to_string(inv.id) + ".txt";
-                ifstream vin(invFile.c_str());
-                if (vin) {
-                    inv.note = "";
-                    inv.lines.clear();
-                    invoices.push_back(inv);
-                }
-            } catch(...) {}
+    MappedFile() {}
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { close(); }
+    bool open(const string& path) {
+        close();
+#ifdef _WIN32
+        ifstream in(path.c_str(), ios::binary);
+        if (!in) return false;
+        buffer.assign((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+        data = buffer.data();
+        size = buffer.size();
+        STATS_ADD(CTR_FILES_OPENED, 1);
+        STATS_ADD(CTR_BYTES_READ, size);
+        return true;
+#else
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0) { ::close(fd); return false; }
+        size = (size_t)st.st_size;
+        if (size > 0) {
+            mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping == MAP_FAILED) { mapping = nullptr; size = 0; ::close(fd); return false; }
+            madvise(mapping, size, MADV_SEQUENTIAL);
+            data = (const char*)mapping;
         }
+        ::close(fd);
+        STATS_ADD(CTR_FILES_OPENED, 1);
+        STATS_ADD(CTR_BYTES_READ, size);
+        return true;
+#endif
     }
-    void save_customer(const Customer& c) {
-        ofstream out(CUSTOMERS_FILE.c_str(), ios::app);
-        out << c.to_csv() << "\n";
-    }
-    void rewrite_customers() {
-        ofstream out(CUSTOMERS_FILE.c_str());
-        for (auto& c : customers) out << c.to_csv() << "\n";
-    }
-    void save_item(const Item& it) {
-        ofstream out(ITEMS_FILE.c_str(), ios::app);
-        out << it.to_csv() << "\n";
-    }
-    void rewrite_items() {
-        ofstream out(ITEMS_FILE.c_str());
-        for (auto& it : items) out << it.to_csv() << "\n";
+    void close() {
+#ifdef _WIN32
+        buffer.clear();
+#else
+        if (mapping) munmap(mapping, size);
+        mapping = nullptr;
+#endif
+        data = nullptr;
+        size = 0;
     }
-    void save_invoice(const Invoice& inv, const Customer& c) {
-        ensure_invoices_folder();
-        string fname = INVOICES_FOLDER + "/invoice_" + to_string(inv.id) + ".txt";
-        ofstream out(fname.c_str());
-        out << inv.to_txt(c);
-        ofstream meta(INVOICES_META_FILE.c_str(), ios::app);
-        meta << inv.meta_csv() << "\n";
-    }
-    Customer* find_customer(int id) {
-        for (auto& c : customers) if (c.id == id) return &c;
-        return nullptr;
+};
+
+template <class F>
+void for_each_line(const char* p, const char* end, F f) {
+    while (p < end) {
+        const char* nl = (const char*)memchr(p, '\n', end - p);
+        const char* e = nl ? nl : end;
+        const char* le = (e > p && e[-1] == '\r') ? e - 1 : e;
+        if (le > p) f(string_view(p, le - p));
+        p = nl ? nl + 1 : end;
     }
-    Item* find_item_by_id(int id) {
-        for (auto& it : items) if (it.id == id) return &it;
-        return nullptr;
+}
+
+size_t split_fields(string_view line, string_view* out, size_t maxFields, char sep = ',') {
+    size_t n = 0;
+    size_t start = 0;
+    while (n < maxFields) {
+        size_t comma = line.find(sep, start);
+        if (comma == string_view::npos) { out[n++] = line.substr(start); break; }
+        out[n++] = line.substr(start, comma - start);
+        start = comma + 1;
     }
-    Item* find_item_by_code(const string& code) {
-        for (auto& it : items) if (it.code == code) return &it;
-        return nullptr;
+    return n;
+}
+
+bool parse_int(string_view s, int& out) {
+    size_t i = 0;
+    while (i < s.size() && isspace((unsigned char)s[i])) ++i;
+    bool neg = i < s.size() && (s[i] == '-' || s[i] == '+') && s[i++] == '-';
+    long long v = 0;
+    size_t digits = 0;
+    for (; i < s.size() && isdigit((unsigned char)s[i]); ++i, ++digits) {
+        v = v * 10 + (s[i] - '0');
+        if (v > numeric_limits<int>::max()) return false;
     }
-    void add_customer() {
-        Customer c;
-        c.id = nextCustomerId++;
-        c.name = input_line("Enter customer name: ");
-        c.address = input_line("Enter address: ");
-        c.email = input_line("Enter email: ");
-        c.phone = input_line("Enter phone: ");
-        customers.push_back(c);
-        save_customer(c);
-        cout << "Customer saved with ID " << c.id << "\n";
+    if (digits == 0) return false;
+    out = (int)(neg ? -v : v);
+    return true;
+}
+
+bool parse_double(string_view s, double& out) {
+    char buf[64];
+    if (s.empty() || s.size() >= sizeof(buf)) return false;
+    memcpy(buf, s.data(), s.size());
+    buf[s.size()] = '\0';
+    char* end = nullptr;
+    out = strtod(buf, &end);
+    return end != buf;
+}
+
+// RFC 4180 reader over a mapped buffer. Unquoted fields, and quoted fields
+// without doubled quotes, are views into the buffer; unescaped fields live in
+// scratch until the next record. A quote inside an unquoted field is data, so
+// older files written without quoting still read the same. A malformed record
+// sets error and is skipped to the end of its line.
+struct CsvParser {
+    const char* p;
+    const char* end;
+    char sep;
+    size_t line = 0;
+    size_t recordLine = 0;
+    const char* error = nullptr;
+    vector<string_view> fields;
+    string scratch;
+    vector<pair<size_t, size_t>> copied;
+
+    CsvParser(const char* begin, const char* stop, char separator = ',') : p(begin), end(stop), sep(separator) {}
+    void skip_blank() {
+        while (p < end && (*p == '\n' || *p == '\r')) line += *p++ == '\n';
     }
-    void list_customers() {
-        cout << left << setw(6) << "ID" << setw(30) << "Name" << setw(30) << "Email" << setw(20) << "Phone" << "\n";
-        cout << string(90, '-') << "\n";
-        for (auto& c : customers) {
-            cout << left << setw(6) << c.id << setw(30) << c.name << setw(30) << c.email << setw(20) << c.phone << "\n";
+    bool next() {
+        fields.clear();
+        scratch.clear();
+        copied.clear();
+        error = nullptr;
+        skip_blank();
+        if (p >= end) return false;
+        recordLine = line + 1;
+        while (true) {
+            if (*p == '"') quoted_field();
+            else {
+                const char* s = p;
+                while (p < end && *p != sep && *p != '\n') ++p;
+                const char* e = (p > s && p[-1] == '\r' && (p == end || *p == '\n')) ? p - 1 : p;
+                fields.push_back(string_view(s, e - s));
+            }
+            if (error) {
+                const char* nl = (const char*)memchr(p, '\n', end - p);
+                p = nl ? nl + 1 : end;
+                line += nl != nullptr;
+                break;
+            }
+            if (p < end && *p == sep) { ++p; if (p < end) continue; fields.push_back(string_view()); }
+            else if (p < end) { ++p; ++line; }
+            break;
         }
+        for (auto& c : copied) fields[c.first] = string_view(scratch.data() + c.second, fields[c.first].size());
+        return true;
     }
-    void search_customers() {
-        string q = input_line("Search by name or email: ");
-        string lowerq = q;
-        transform(lowerq.begin(), lowerq.end(), lowerq.begin(), ::tolower);
-        cout << left << setw(6) << "ID" << setw(30) << "Name" << setw(30) << "Email" << setw(20) << "Phone" << "\n";
-        cout << string(90, '-') << "\n";
-        for (auto& c : customers) {
-            string l = c.name + " " + c.email;
-            string lower = l;
-            transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
-            if (lower.find(lowerq) != string::npos) {
-                cout << left << setw(6) << c.id << setw(30) << c.name << setw(30) << c.email << setw(20) << c.phone << "\n";
+    void quoted_field() {
+        const char* s = ++p;
+        size_t off = string::npos;
+        while (true) {
+            const char* q = (const char*)memchr(p, '"', end - p);
+            line += count(p, q ? q : end, '\n');
+            if (!q) { p = end; error = "unterminated quoted field"; return; }
+            if (q + 1 < end && q[1] == '"') {
+                if (off == string::npos) off = scratch.size();
+                scratch.append(s, q + 1 - s);
+                p = s = q + 2;
+                continue;
             }
+            p = q + 1;
+            if (off == string::npos) fields.push_back(string_view(s, q - s));
+            else {
+                scratch.append(s, q - s);
+                copied.push_back(make_pair(fields.size(), off));
+                fields.push_back(string_view(s, scratch.size() - off));
+            }
+            break;
         }
+        if (p < end && *p == '\r' && (p + 1 == end || p[1] == '\n')) ++p;
+        if (p < end && *p != sep && *p != '\n') error = "unexpected character after closing quote";
     }
-    void add_item() {
-        Item it;
-        it.id = nextItemId++;
-        it.code = input_line("Enter item code (SKU): ");
-        it.description = input_line("Enter description: ");
-        it.unitPrice = input_double("Enter unit price: ");
-        it.taxPercent = input_double("Enter tax percent: ");
-        items.push_back(it);
-        save_item(it);
-        cout << "Item saved with ID " << it.id << "\n";
+};
+
+// Appends v as one field, quoted only when it holds a separator, quote or
+// line break.
+void csv_append(string& out, string_view v, char sep = ',') {
+    const char special[] = { sep, '"', '\n', '\r' };
+    if (v.find_first_of(string_view(special, sizeof(special))) == string_view::npos) {
+        out.append(v.data(), v.size());
+        return;
     }
-    void list_items() {
-        cout << left << setw(6) << "ID" << setw(12) << "SKU" << setw(40) << "Description" << setw(12) << "Price" << setw(8) << "Tax" << "\n";
-        cout << string(80, '-') << "\n";
-        for (auto& it : items) {
-            cout << left << setw(6) << it.id << setw(12) << it.code << setw(40) << it.description << setw(12) << fixed << setprecision(2) << it.unitPrice << setw(8) << it.taxPercent << "\n";
-        }
+    out += '"';
+    for (char ch : v) {
+        if (ch == '"') out += '"';
+        out += ch;
     }
-    void search_items() {
-        string q = input_line("Search by SKU or description: ");
-        string lowerq = q;
-        transform(lowerq.begin(), lowerq.end(), lowerq.begin(), ::tolower);
-        cout << left << setw(6) << "ID" << setw(12) << "SKU" << setw(40) << "Description" << setw(12) << "Price" << setw(8) << "Tax" << "\n";
-        cout << string(80, '-') << "\n";
-        for (auto& it : items) {
-            string l = it.code + " " + it.description;
-            string lower = l;
-            transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
-            if (lower.find(lowerq) != string::npos) {
-                cout << left << setw(6) << it.id << setw(12) << it.code << setw(40) << it.description << setw(12) << fixed << setprecision(2) << it.unitPrice << setw(8) << it.taxPercent << "\n";
-            }
-        }
+    out += '"';
+}
+
+struct CsvReject {
+    size_t line;
+    string reason;
+};
+
+template <class Row>
+struct CsvChunk {
+    const char* begin;
+    const char* limit;
+    const char* stop = nullptr;
+    size_t lines = 0;
+    vector<Row> rows;
+    vector<CsvReject> rejects;
+};
+
+// Parses the records that start in [c.begin, c.limit); the last one may run
+// past limit. parse returns nullptr to accept a row or the rejection reason.
+template <class Row, class F>
+void parse_csv_chunk(CsvChunk<Row>& c, const char* end, F& parse) {
+    CsvParser ps(c.begin, end);
+    c.rows.clear();
+    c.rejects.clear();
+    Row row;
+    while (true) {
+        ps.skip_blank();
+        if (ps.p >= c.limit || !ps.next()) break;
+        const char* why = ps.error ? ps.error : parse(ps.fields.data(), ps.fields.size(), row);
+        if (why) c.rejects.push_back(CsvReject{ ps.recordLine, why });
+        else c.rows.push_back(move(row));
     }
-    void create_invoice() {
-        if (customers.empty()) { cout << "No customers defined. Add customer first.\n"; return; }
-        if (items.empty()) { cout << "No items defined. Add items first.\n"; return; }
-        Invoice inv;
-        inv.id = nextInvoiceId++;
-        int cid = input_int("Enter customer ID: ");
-        Customer* c = find_customer(cid);
-        if (!c) { cout << "Customer not found.\n"; return; }
-        inv.customerId = cid;
-        inv.date = now_date();
-        inv.note = "";
-        inv.discountPercent = 0.0;
-        inv.shipping = 0.0;
-        while (true) {
-            string yn = input_line("Add line? (y/n): ");
-            if (yn.empty() || (yn[0] != 'y' && yn[0] != 'Y')) break;
-            string key = input_line("Enter SKU or item ID: ");
-            Item* it = nullptr;
-            bool digits = !key.empty() && all_of(key.begin(), key.end(), ::isdigit);
-            if (digits) it = find_item_by_id(stoi(key));
-            if (!it) it = find_item_by_code(key);
-            if (!it) { cout << "Item not found. Try again.\n"; continue; }
-            InvoiceLine L;
-            L.itemId = it->id;
-            L.description = it->description;
-            L.unitPrice = it->unitPrice;
-            L.taxPercent = it->taxPercent;
-            L.quantity = input_double("Enter quantity: ");
-            inv.lines.push_back(L);
-        }
-        inv.discountPercent = input_double("Enter discount percent (0 for none): ", true, 0.0);
-        inv.shipping = input_double("Enter shipping amount: ", true, 0.0);
-        inv.note = input_line("Enter optional note: ");
-        save_invoice(inv, *c);
-        cout << "Invoice created and saved as " << INVOICES_FOLDER << "/invoice_" << inv.id << ".txt\n";
+    c.stop = ps.p;
+    c.lines = ps.line;
+}
+
+// Splits [begin, end) at line breaks and parses the pieces in parallel,
+// assuming each piece starts outside a quoted field. A piece whose predecessor
+// stopped somewhere else (a quoted line break straddled the split) is parsed
+// again from the right place, so the result matches a sequential parse.
+// firstLine is the number of lines before begin; rows come back in file order.
+template <class Row, class F>
+void parse_csv_parallel(const char* begin, const char* end, size_t firstLine, size_t threads, F parse,
+                        vector<Row>& rows, vector<CsvReject>& rejects) {
+    size_t size = end - begin;
+    size_t workers = max<size_t>(1, min<size_t>(threads, size / (1 << 20)));
+    vector<CsvChunk<Row>> chunks(workers);
+    for (size_t w = 0; w < workers; ++w) {
+        const char* target = begin + size * w / workers;
+        const char* nl = w ? (const char*)memchr(target, '\n', end - target) : nullptr;
+        chunks[w].begin = w == 0 ? begin : max(nl ? nl + 1 : end, chunks[w - 1].begin);
+        if (w) chunks[w - 1].limit = chunks[w].begin;
     }
-    void list_invoices_meta() {
-        ifstream meta(INVOICES_META_FILE.c_str());
-        if (!meta) { cout << "No invoices found.\n"; return; }
-        cout << left << setw(8) << "InvID" << setw(10) << "CustID" << setw(15) << "Date" << setw(12) << "Discount" << setw(12) << "Shipping" << "\n";
-        cout << string(60, '-') << "\n";
-        string line;
-        while (getline(meta, line)) {
-            if (line.empty()) continue;
-            stringstream ss(line);
-            string id, cust, date, disc, ship;
-            getline(ss, id, ','); getline(ss, cust, ','); getline(ss, date, ','); getline(ss, disc, ','); getline(ss, ship, ',');
-            cout << left << setw(8) << id << setw(10) << cust << setw(15) << date << setw(12) << disc << setw(12) << ship << "\n";
+    chunks.back().limit = end;
+    vector<thread> pool;
+    for (size_t w = 1; w < workers; ++w) pool.emplace_back([&, w] { parse_csv_chunk(chunks[w], end, parse); });
+    parse_csv_chunk(chunks[0], end, parse);
+    for (auto& t : pool) t.join();
+    size_t base = firstLine;
+    for (size_t w = 0; w < workers; ++w) {
+        if (w && chunks[w].begin != chunks[w - 1].stop) {
+            chunks[w].begin = chunks[w - 1].stop;
+            chunks[w].limit = max(chunks[w].limit, chunks[w].begin);
+            parse_csv_chunk(chunks[w], end, parse);
         }
+        for (auto& r : chunks[w].rejects) rejects.push_back(CsvReject{ base + r.line, move(r.reason) });
+        if (rows.empty()) rows.swap(chunks[w].rows);
+        else rows.insert(rows.end(), make_move_iterator(chunks[w].rows.begin()), make_move_iterator(chunks[w].rows.end()));
+        base += chunks[w].lines;
     }
-    void view_invoice_file() {
-        string s = input_line("Enter invoice ID to view: ");
-        string fname = INVOICES_FOLDER + "/invoice_" + s + ".txt";
-        ifstream in(fname.c_str());
-        if (!in) { cout << "Invoice file not found.\n"; return; }
-        string content((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
-        cout << content << "\n";
-    }
-    void export_report_sales() {
-        string start = input_line("Enter start date (YYYY-MM-DD): ");
-        string end = input_line("Enter end date (YYYY-MM-DD): ");
-        double totalSales = 0;
-        ifstream meta(INVOICES_META_FILE.c_str());
-        if (!meta) { cout << "No invoices found.\n"; return; }
-        string line;
-        cout << left << setw(8) << "InvID" << setw(10) << "CustID" << setw(12) << "Date" << setw(12) << "Total" << "\n";
-        cout << string(50, '-') << "\n";
-        while (getline(meta, line)) {
-            if (line.empty()) continue;
-            stringstream ss(line);
-            string id, cust, date, disc, ship;
-            getline(ss, id, ','); getline(ss, cust, ','); getline(ss, date, ','); getline(ss, disc, ','); getline(ss, ship, ',');
-            if (date < start || date > end) continue;
-            string fname = INVOICES_FOLDER + "/invoice_" + id + ".txt";
-            ifstream invf(fname.c_str());
-            if (!invf) continue;
-            string l;
-            while (getline(invf, l)) {
-                if (l.find("TOTAL:") != string::npos) {
-                    stringstream ss2(l);
-                    string tmp;
-                    vector<string> parts;
-                    while (ss2 >> tmp) parts.push_back(tmp);
-                    if (!parts.empty()) {
-                        string num = parts.back();
-                        double val = atof(num.c_str());
-                        cout << left << setw(8) << id << setw(10) << cust << setw(12) << date << setw(12) << fixed << setprecision(2) << val << "\n";
-                        totalSales += val;
-                    }
-                    break;
+}
+
+// Runs task(worker, i) for every i in [0, n) on up to threads threads. The
+// range is cut into grain-sized chunks dealt out evenly to per-worker
+// deques; a worker takes chunks from the front of its own deque and, once
+// that is empty, steals from the back of another's, so a slow share does
+// not hold up the rest.
+template <class F>
+void work_stealing_for(size_t n, size_t threads, size_t grain, F task) {
+    struct Queue {
+        mutex lock;
+        deque<pair<size_t, size_t>> chunks;
+    };
+    size_t nChunks = (n + grain - 1) / grain;
+    size_t workers = max<size_t>(1, min(threads, nChunks));
+    vector<Queue> queues(workers);
+    for (size_t c = 0; c < nChunks; ++c) queues[c * workers / nChunks].chunks.emplace_back(c * grain, min(n, (c + 1) * grain));
+    auto work = [&](size_t w) {
+        while (true) {
+            pair<size_t, size_t> chunk;
+            bool found = false;
+            for (size_t k = 0; k < workers && !found; ++k) {
+                Queue& q = queues[(w + k) % workers];
+                lock_guard<mutex> g(q.lock);
+                if (q.chunks.empty()) continue;
+                if (k == 0) {
+                    chunk = q.chunks.front();
+                    q.chunks.pop_front();
+                } else {
+                    chunk = q.chunks.back();
+                    q.chunks.pop_back();
                 }
+                found = true;
             }
+            if (!found) return;
+            for (size_t i = chunk.first; i < chunk.second; ++i) task(w, i);
         }
-        cout << string(50, '-') << "\n";
-        cout << left << setw(30) << "TOTAL SALES: " << setw(12) << fixed << setprecision(2) << totalSales << "\n";
+    };
+    vector<thread> pool;
+    for (size_t w = 1; w < workers; ++w) pool.emplace_back(work, w);
+    work(0);
+    for (auto& t : pool) t.join();
+}
+
+struct BinaryWriter {
+    string buf;
+    void put_u32(uint32_t v) { buf.append((const char*)&v, sizeof(v)); }
+    void put_i32(int32_t v) { buf.append((const char*)&v, sizeof(v)); }
+    void put_i64(int64_t v) { buf.append((const char*)&v, sizeof(v)); }
+    void put_f64(double v) { buf.append((const char*)&v, sizeof(v)); }
+    void put_str(string_view v) { put_u32((uint32_t)v.size()); buf.append(v.data(), v.size()); }
+};
+
+struct BinaryReader {
+    const char* p;
+    const char* end;
+    bool ok = true;
+    BinaryReader(const char* data, size_t size) : p(data), end(data + size) {}
+    bool take(void* out, size_t n) {
+        if (!ok || (size_t)(end - p) < n) { ok = false; return false; }
+        memcpy(out, p, n);
+        p += n;
+        return true;
     }
-    void remove_customer() {
-        int id = input_int("Enter customer ID to remove: ");
-        auto it = find_if(customers.begin(), customers.end(), [&](const Customer& c){ return c.id == id; });
-        if (it == customers.end()) { cout << "Not found.\n"; return; }
-        customers.erase(it);
-        rewrite_customers();
-        cout << "Customer removed.\n";
+    uint32_t get_u32() { uint32_t v = 0; take(&v, sizeof(v)); return v; }
+    int32_t get_i32() { int32_t v = 0; take(&v, sizeof(v)); return v; }
+    int64_t get_i64() { int64_t v = 0; take(&v, sizeof(v)); return v; }
+    double get_f64() { double v = 0; take(&v, sizeof(v)); return v; }
+    string get_str() { return string(get_view()); }
+    string_view get_view() {
+        uint32_t n = get_u32();
+        if (!ok || (size_t)(end - p) < n) { ok = false; return string_view(); }
+        string_view v(p, n);
+        p += n;
+        return v;
     }
-    void remove_item() {
-        int id = input_int("Enter item ID to remove: ");
-        auto it = find_if(items.begin(), items.end(), [&](const Item& i){ return i.id == id; });
-        if (it == items.end()) { cout << "Not found.\n"; return; }
-        items.erase(it);
-        rewrite_items();
-        cout << "Item removed.\n";
+};
+
+// Size, inode and modification and change times in nanoseconds where the
+// platform has them; a file rewritten in place or replaced by a rename
+// within the same second still gets a new stamp.
+struct FileStamp {
+    int64_t size;
+    int64_t mtime;
+    int64_t ctime;
+    int64_t inode;
+    bool operator==(const FileStamp& o) const { return size == o.size && mtime == o.mtime && ctime == o.ctime && inode == o.inode; }
+};
+
+FileStamp file_stamp(const string& path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) return FileStamp{ -1, 0, 0, 0 };
+#if defined(__APPLE__)
+    int64_t m = (int64_t)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+    int64_t c = (int64_t)st.st_ctimespec.tv_sec * 1000000000 + st.st_ctimespec.tv_nsec;
+#elif defined(_WIN32)
+    int64_t m = (int64_t)st.st_mtime * 1000000000;
+    int64_t c = (int64_t)st.st_ctime * 1000000000;
+#else
+    int64_t m = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    int64_t c = (int64_t)st.st_ctim.tv_sec * 1000000000 + st.st_ctim.tv_nsec;
+#endif
+    return FileStamp{ (int64_t)st.st_size, m, c, (int64_t)st.st_ino };
+}
+
+// Resident set size of this process, or 0 where it is not available.
+size_t resident_bytes() {
+#ifdef __linux__
+    long pages = 0, resident = 0;
+    FILE* f = fopen("/proc/self/statm", "r");
+    if (!f) return 0;
+    if (fscanf(f, "%ld %ld", &pages, &resident) != 2) resident = 0;
+    fclose(f);
+    return (size_t)resident * (size_t)sysconf(_SC_PAGESIZE);
+#else
+    return 0;
+#endif
+}
+
+bool replace_file(const string& tmp, const string& path) {
+#ifdef _WIN32
+    remove(path.c_str());
+#endif
+    return rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+// Makes a rename in path's directory durable; a no-op where directories
+// cannot be synced.
+bool sync_parent_directory(const string& path) {
+#ifdef _WIN32
+    (void)path;
+    return true;
+#else
+    size_t slash = path.rfind('/');
+    string dir = slash == string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+    int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0) return false;
+    bool synced = fsync(fd) == 0;
+    ::close(fd);
+    STATS_ADD(CTR_FSYNCS, 1);
+    return synced;
+#endif
+}
+
+bool write_file_atomic(const string& path, const string& data) {
+    string tmp = path + ".tmp";
+    STATS_ADD(CTR_FILES_OPENED, 1);
+    STATS_ADD(CTR_BYTES_WRITTEN, data.size());
+#ifdef _WIN32
+    {
+        ofstream out(tmp.c_str(), ios::binary | ios::trunc);
+        out.write(data.data(), data.size());
+        out.flush();
+        if (!out) return false;
+    }
+#else
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t n = ::write(fd, data.data() + done, data.size() - done);
+        if (n <= 0) { ::close(fd); remove(tmp.c_str()); return false; }
+        done += (size_t)n;
+    }
+    bool synced = fsync(fd) == 0;
+    ::close(fd);
+    if (!synced) { remove(tmp.c_str()); return false; }
+#endif
+    return replace_file(tmp, path) && sync_parent_directory(path);
+}
+
+// Money is a count of minor units (cents). Quantities are held in
+// thousandths and percentages in basis points, so every line product is an
+// exact integer; rounding happens once per displayed or stored amount,
+// half away from zero.
+static const int64_t QTY_SCALE = 1000;
+static const int64_t BP_SCALE = 10000;
+
+int64_t round_div(int64_t num, int64_t den) {
+    int64_t q = num / den;
+    int64_t r = num % den;
+    if (2 * (r < 0 ? -r : r) >= den) q += (num < 0) ? -1 : 1;
+    return q;
+}
+
+int64_t mul_div_round(int64_t a, int64_t b, int64_t den) {
+#ifdef __SIZEOF_INT128__
+    __int128 num = (__int128)a * b;
+    __int128 q = num / den;
+    __int128 r = num % den;
+    if (2 * (r < 0 ? -r : r) >= den) q += (num < 0) ? -1 : 1;
+    return (int64_t)q;
+#else
+    long double v = (long double)a * b / den;
+    return (int64_t)(v < 0 ? v - 0.5L : v + 0.5L);
+#endif
+}
+
+// Values beyond the int64 range saturate and NaN becomes 0, rather than
+// reaching llround with an unrepresentable result.
+int64_t scale_double(double v, int64_t scale) {
+    double x = v * (double)scale;
+    if (!(x == x)) return 0;
+    if (x >= 9.2e18) return numeric_limits<int64_t>::max();
+    if (x <= -9.2e18) return numeric_limits<int64_t>::min();
+    return (int64_t)llround(x);
+}
+
+bool parse_decimal(string_view s, int64_t scale, int64_t& out) {
+    size_t i = 0;
+    while (i < s.size() && isspace((unsigned char)s[i])) ++i;
+    bool neg = i < s.size() && (s[i] == '-' || s[i] == '+') && s[i++] == '-';
+    int64_t whole = 0;
+    size_t digits = 0;
+    for (; i < s.size() && isdigit((unsigned char)s[i]); ++i, ++digits) {
+        if (whole > (numeric_limits<int64_t>::max() / scale - 9) / 10) return false;
+        whole = whole * 10 + (s[i] - '0');
+    }
+    int64_t frac = 0;
+    int64_t unit = scale;
+    bool roundUp = false;
+    if (i < s.size() && s[i] == '.') {
+        for (++i; i < s.size() && isdigit((unsigned char)s[i]); ++i, ++digits) {
+            if (unit > 1) {
+                unit /= 10;
+                frac += (s[i] - '0') * unit;
+            } else if (unit == 1) {
+                roundUp = s[i] >= '5';
+                unit = 0;
+            }
+        }
     }
+    if (digits == 0) return false;
+    int64_t v = whole * scale + frac + (roundUp ? 1 : 0);
+    out = neg ? -v : v;
+    return true;
+}
+
+size_t format_hundredths(char* out, int64_t v) {
+    uint64_t a = v < 0 ? 0 - (uint64_t)v : (uint64_t)v;
+    char* p = out;
+    if (v < 0) *p++ = '-';
+    p = to_chars(p, p + 24, a / 100).ptr;
+    *p++ = '.';
+    *p++ = (char)('0' + a % 100 / 10);
+    *p++ = (char)('0' + a % 10);
+    return (size_t)(p - out);
+}
+
+string format_hundredths(int64_t v) {
+    char buf[32];
+    return string(buf, format_hundredths(buf, v));
+}
+
+struct Money {
+    int64_t minor = 0;
+    static Money cents(int64_t v) { Money m; m.minor = v; return m; }
+    static Money from_double(double v) { return cents(scale_double(v, 100)); }
+    static bool parse(string_view s, Money& out) { return parse_decimal(s, 100, out.minor); }
+    double to_double() const { return (double)minor / 100.0; }
+    string str() const { return format_hundredths(minor); }
+    Money operator+(Money o) const { return cents(minor + o.minor); }
+    Money operator-(Money o) const { return cents(minor - o.minor); }
+    Money operator-() const { return cents(-minor); }
+    Money& operator+=(Money o) { minor += o.minor; return *this; }
+    bool operator==(Money o) const { return minor == o.minor; }
 };
 
-void pause() {
-    cout << "\nPress ENTER to continue..." << flush;
-    string s;
-    getline(cin, s);
+string fold_case(string_view s) {
+    string out(s);
+    for (auto& ch : out) ch = (char)tolower((unsigned char)ch);
+    return out;
 }
 
-int main() {
+// Estimated footprint of a node-based hash table: the bucket array plus one
+// allocation per element holding the value, a next pointer and a cached hash.
+template <class Table>
+size_t hash_table_bytes(const Table& t) {
+    return t.bucket_count() * sizeof(void*) + t.size() * (sizeof(typename Table::value_type) + 2 * sizeof(void*) + 16);
+}
+
+size_t find_substring(string_view hay, string_view needle) {
+    const size_t n = needle.size();
+    if (n == 0) return 0;
+    if (n > hay.size()) return string_view::npos;
+    size_t i = 0;
+#if defined(__SSE2__) && defined(__GNUC__)
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[n - 1]);
+    for (; i + n + 15 <= hay.size(); i += 16) {
+        __m128i bf = _mm_loadu_si128((const __m128i*)(hay.data() + i));
+        __m128i bl = _mm_loadu_si128((const __m128i*)(hay.data() + i + n - 1));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, bf), _mm_cmpeq_epi8(last, bl)));
+        while (mask) {
+            unsigned bit = (unsigned)__builtin_ctz(mask);
+            if (memcmp(hay.data() + i + bit, needle.data(), n) == 0) return i + bit;
+            mask &= mask - 1;
+        }
+    }
+#endif
+    size_t pos = hay.substr(i).find(needle);
+    return pos == string_view::npos ? pos : i + pos;
+}
+
+// Append-only arena for record strings. Values are stored with a 4-byte
+// length prefix in 1 MB blocks that never move, so a PooledStr (one pointer)
+// stays valid until clear(). intern() returns the stored copy of a value seen
+// before, for fields that repeat such as addresses. Space held by replaced or
+// removed values is reclaimed on the next full load.
+struct PooledStr {
+    const char* p = nullptr;
+    string_view view() const {
+        if (!p) return string_view();
+        uint32_t n;
+        memcpy(&n, p, sizeof(n));
+        return string_view(p + sizeof(n), n);
+    }
+    size_t footprint() const { return p ? sizeof(uint32_t) + view().size() : 0; }
+};
+
+// Strings are never freed one by one, so replaced and removed values stay
+// until the owner copies its live strings to a fresh pool. Owners check
+// once the pool has doubled since the last check (due()) and rebuild only
+// if less than half of it is live, which keeps the cost amortised.
+struct StringPool {
+    static const size_t BLOCK_SIZE = 1 << 20;
+    vector<unique_ptr<char[]>> blocks;
+    unordered_set<string_view> interned;
+    char* block = nullptr;
+    size_t used = 0;
+    size_t bytes = 0;
+    size_t checkedAt = 0;
+
+    bool due() const { return bytes >= 2 * max(checkedAt, (size_t)BLOCK_SIZE); }
+    // Records a check; returns whether live bytes are too few to keep the
+    // pool.
+    bool wasteful(size_t live) {
+        checkedAt = bytes;
+        return live * 2 < bytes;
+    }
+
+    char* allocate(size_t n) {
+        blocks.emplace_back(new char[n]);
+        bytes += n;
+        return blocks.back().get();
+    }
+    PooledStr add(string_view s) {
+        PooledStr r;
+        if (s.empty()) return r;
+        uint32_t n = (uint32_t)s.size();
+        size_t need = sizeof(n) + n;
+        char* dst;
+        if (need > BLOCK_SIZE / 4) dst = allocate(need);
+        else {
+            if (!block || BLOCK_SIZE - used < need) {
+                block = allocate(BLOCK_SIZE);
+                used = 0;
+            }
+            dst = block + used;
+            used += need;
+        }
+        memcpy(dst, &n, sizeof(n));
+        memcpy(dst + sizeof(n), s.data(), n);
+        r.p = dst;
+        return r;
+    }
+    PooledStr intern(string_view s) {
+        auto f = interned.find(s);
+        PooledStr r;
+        if (f != interned.end()) r.p = f->data() - sizeof(uint32_t);
+        else if ((r = add(s)).p) interned.insert(r.view());
+        return r;
+    }
+    void clear() {
+        blocks.clear();
+        interned.clear();
+        block = nullptr;
+        used = 0;
+        bytes = 0;
+        checkedAt = 0;
+    }
+    size_t memory() const { return bytes + hash_table_bytes(interned); }
+};
+
+// Case-folded trigram inverted index. Postings are kept sorted by record id
+// so a query intersects the lists of its trigrams, shortest first, and then
+// confirms each candidate with a substring check on the folded text.
+struct SearchIndex {
+    unordered_map<uint32_t, vector<int>> postings;
+    unordered_map<int, string_view> folded;
+    StringPool text;
+
+    static uint32_t trigram(const char* p) {
+        return ((uint32_t)(unsigned char)p[0] << 16) | ((uint32_t)(unsigned char)p[1] << 8) | (unsigned char)p[2];
+    }
+    static vector<uint32_t> trigrams(string_view s) {
+        vector<uint32_t> v;
+        for (size_t i = 0; i + 3 <= s.size(); ++i) v.push_back(trigram(s.data() + i));
+        sort(v.begin(), v.end());
+        v.erase(unique(v.begin(), v.end()), v.end());
+        return v;
+    }
+    void clear() {
+        postings.clear();
+        folded.clear();
+        text.clear();
+    }
+    void add(int id, string_view s) {
+        remove(id);
+        compact_text();
+        string_view f = folded[id] = text.add(fold_case(s)).view();
+        for (uint32_t t : trigrams(f)) {
+            vector<int>& list = postings[t];
+            if (list.empty() || list.back() < id) list.push_back(id);
+            else {
+                auto pos = lower_bound(list.begin(), list.end(), id);
+                if (pos == list.end() || *pos != id) list.insert(pos, id);
+            }
+        }
+    }
+    void remove(int id) {
+        auto f = folded.find(id);
+        if (f == folded.end()) return;
+        for (uint32_t t : trigrams(f->second)) {
+            auto p = postings.find(t);
+            if (p == postings.end()) continue;
+            auto pos = lower_bound(p->second.begin(), p->second.end(), id);
+            if (pos != p->second.end() && *pos == id) p->second.erase(pos);
+            if (p->second.empty()) postings.erase(p);
+        }
+        folded.erase(f);
+        compact_text();
+    }
+    void compact_text() {
+        if (!text.due()) return;
+        size_t live = 0;
+        for (auto& e : folded) live += sizeof(uint32_t) + e.second.size();
+        if (!text.wasteful(live)) return;
+        StringPool fresh;
+        for (auto& e : folded) e.second = fresh.add(e.second).view();
+        text = move(fresh);
+        text.checkedAt = text.bytes;
+    }
+    // Returns up to limit ids ordered by match position, then record length,
+    // then id; total receives the number of matching records.
+    vector<int> query(const string& q, size_t limit, size_t& total) const {
+        string fq = fold_case(q);
+        struct Hit { size_t pos; size_t len; int id; };
+        vector<Hit> hits;
+        auto check = [&](int id, string_view s) {
+            STATS_ADD(CTR_RECORDS_SCANNED, 1);
+            size_t pos = find_substring(s, fq);
+            if (pos != string_view::npos) hits.push_back(Hit{ pos, s.size(), id });
+        };
+        if (fq.size() < 3) {
+            for (auto& e : folded) check(e.first, e.second);
+        } else {
+            vector<const vector<int>*> lists;
+            for (uint32_t t : trigrams(fq)) {
+                auto p = postings.find(t);
+                if (p == postings.end()) { total = 0; return vector<int>(); }
+                lists.push_back(&p->second);
+            }
+            sort(lists.begin(), lists.end(), [](const vector<int>* a, const vector<int>* b) { return a->size() < b->size(); });
+            vector<int> cand(*lists[0]);
+            vector<int> tmp;
+            for (size_t i = 1; i < lists.size() && !cand.empty(); ++i) {
+                tmp.clear();
+                set_intersection(cand.begin(), cand.end(), lists[i]->begin(), lists[i]->end(), back_inserter(tmp));
+                cand.swap(tmp);
+            }
+            for (int id : cand) check(id, folded.find(id)->second);
+        }
+        total = hits.size();
+        size_t n = min(limit, hits.size());
+        partial_sort(hits.begin(), hits.begin() + n, hits.end(), [](const Hit& a, const Hit& b) {
+            if (a.pos != b.pos) return a.pos < b.pos;
+            if (a.len != b.len) return a.len < b.len;
+            return a.id < b.id;
+        });
+        vector<int> ids;
+        for (size_t i = 0; i < n; ++i) ids.push_back(hits[i].id);
+        return ids;
+    }
+    // Drops the spare capacity postings pick up while an index is built.
+    void shrink() {
+        for (auto& p : postings) p.second.shrink_to_fit();
+    }
+    size_t memory() const {
+        size_t n = hash_table_bytes(postings) + hash_table_bytes(folded) + text.memory();
+        for (auto& p : postings) n += p.second.capacity() * sizeof(int);
+        return n;
+    }
+};
+
+// A stored customer as read from CustomerTable; the views point into the
+// table's string pool.
+struct CustomerRow {
+    int id = 0;
+    string_view name;
+    string_view address;
+    string_view email;
+    string_view phone;
+    bool found = false;
+    explicit operator bool() const { return found; }
+    string to_csv() const {
+        string s = to_string(id);
+        for (string_view f : { name, address, email, phone }) {
+            s += ',';
+            csv_append(s, f);
+        }
+        return s;
+    }
+};
+
+struct Customer {
+    int id;
+    string name;
+    string address;
+    string email;
+    string phone;
+    CustomerRow row() const {
+        CustomerRow r;
+        r.id = id;
+        r.name = name;
+        r.address = address;
+        r.email = email;
+        r.phone = phone;
+        r.found = true;
+        return r;
+    }
+    static bool from_fields(const string_view* f, size_t n, Customer& c) {
+        if (n < 1 || !parse_int(f[0], c.id)) return false;
+        c.name.assign(n > 1 ? f[1] : string_view());
+        c.address.assign(n > 2 ? f[2] : string_view());
+        c.email.assign(n > 3 ? f[3] : string_view());
+        c.phone.assign(n > 4 ? f[4] : string_view());
+        return true;
+    }
+    static Customer from_csv(const string& line) {
+        CsvParser ps(line.data(), line.data() + line.size());
+        Customer c;
+        if (!ps.next() || ps.error || !from_fields(ps.fields.data(), ps.fields.size(), c)) throw invalid_argument("customer row");
+        return c;
+    }
+    string to_csv() const { return row().to_csv(); }
+};
+
+struct ItemRow {
+    int id = 0;
+    string_view code;
+    string_view description;
+    Money unitPrice;
+    int32_t taxBp = 0;
+    bool found = false;
+    explicit operator bool() const { return found; }
+    double taxPercent() const { return (double)taxBp / 100.0; }
+    string to_csv() const {
+        string s = to_string(id);
+        s += ',';
+        csv_append(s, code);
+        s += ',';
+        csv_append(s, description);
+        s += ',' + unitPrice.str() + ',' + format_hundredths(taxBp);
+        return s;
+    }
+};
+
+struct Item {
+    int id;
+    string code;
+    string description;
+    Money unitPrice;
+    int32_t taxBp;
+    double taxPercent() const { return (double)taxBp / 100.0; }
+    ItemRow row() const {
+        ItemRow r;
+        r.id = id;
+        r.code = code;
+        r.description = description;
+        r.unitPrice = unitPrice;
+        r.taxBp = taxBp;
+        r.found = true;
+        return r;
+    }
+    static bool from_fields(const string_view* f, size_t n, Item& it) {
+        int64_t bp;
+        if (n < 5 || !parse_int(f[0], it.id)) return false;
+        it.code.assign(f[1]);
+        it.description.assign(f[2]);
+        if (!Money::parse(f[3], it.unitPrice) || !parse_decimal(f[4], 100, bp)) return false;
+        it.taxBp = (int32_t)bp;
+        return true;
+    }
+    static Item from_csv(const string& line) {
+        CsvParser ps(line.data(), line.data() + line.size());
+        Item it;
+        if (!ps.next() || ps.error || !from_fields(ps.fields.data(), ps.fields.size(), it)) throw invalid_argument("item row");
+        return it;
+    }
+    string to_csv() const { return row().to_csv(); }
+};
+
+template <class Table, class Row>
+struct RowIterator {
+    const Table* table;
+    size_t i;
+    Row operator*() const { return (*table)[i]; }
+    RowIterator& operator++() { ++i; return *this; }
+    bool operator!=(const RowIterator& o) const { return i != o.i; }
+};
+
+// Customers stored column-wise: one id array and a pooled string per text
+// field (8 bytes each) instead of four std::string objects and their heap
+// blocks. Addresses are interned. Rows are returned by value as views.
+struct CustomerTable {
+    vector<int32_t> id;
+    vector<PooledStr> name;
+    vector<PooledStr> address;
+    vector<PooledStr> email;
+    vector<PooledStr> phone;
+    StringPool pool;
+    typedef RowIterator<CustomerTable, CustomerRow> iterator;
+
+    size_t size() const { return id.size(); }
+    bool empty() const { return id.empty(); }
+    void clear() {
+        id.clear();
+        name.clear();
+        address.clear();
+        email.clear();
+        phone.clear();
+        pool.clear();
+    }
+    void reserve(size_t n) {
+        id.reserve(n);
+        name.reserve(n);
+        address.reserve(n);
+        email.reserve(n);
+        phone.reserve(n);
+    }
+    void push_back(const CustomerRow& c) {
+        id.push_back(c.id);
+        name.push_back(pool.add(c.name));
+        address.push_back(pool.intern(c.address));
+        email.push_back(pool.add(c.email));
+        phone.push_back(pool.add(c.phone));
+    }
+    void push_back(const Customer& c) { push_back(c.row()); }
+    void set(size_t i, const CustomerRow& c) {
+        id[i] = c.id;
+        name[i] = pool.add(c.name);
+        address[i] = pool.intern(c.address);
+        email[i] = pool.add(c.email);
+        phone[i] = pool.add(c.phone);
+    }
+    void erase(size_t i) {
+        id.erase(id.begin() + i);
+        name.erase(name.begin() + i);
+        address.erase(address.begin() + i);
+        email.erase(email.begin() + i);
+        phone.erase(phone.begin() + i);
+    }
+    void move_row(size_t dst, size_t src) {
+        id[dst] = id[src];
+        name[dst] = name[src];
+        address[dst] = address[src];
+        email[dst] = email[src];
+        phone[dst] = phone[src];
+    }
+    void resize(size_t n) {
+        id.resize(n);
+        name.resize(n);
+        address.resize(n);
+        email.resize(n);
+        phone.resize(n);
+    }
+    CustomerRow operator[](size_t i) const {
+        CustomerRow r;
+        r.id = id[i];
+        r.name = name[i].view();
+        r.address = address[i].view();
+        r.email = email[i].view();
+        r.phone = phone[i].view();
+        r.found = true;
+        return r;
+    }
+    // Drops strings no row refers to any more; rows read before the call
+    // must not be used after it.
+    void compact_pool() {
+        if (!pool.due()) return;
+        size_t live = 0;
+        for (size_t i = 0; i < size(); ++i) live += name[i].footprint() + address[i].footprint() + email[i].footprint() + phone[i].footprint();
+        if (!pool.wasteful(live)) return;
+        StringPool fresh;
+        for (size_t i = 0; i < size(); ++i) {
+            name[i] = fresh.add(name[i].view());
+            address[i] = fresh.intern(address[i].view());
+            email[i] = fresh.add(email[i].view());
+            phone[i] = fresh.add(phone[i].view());
+        }
+        pool = move(fresh);
+        pool.checkedAt = pool.bytes;
+    }
+    iterator begin() const { return iterator{ this, 0 }; }
+    iterator end() const { return iterator{ this, size() }; }
+    size_t memory() const {
+        return pool.memory() + id.capacity() * sizeof(int32_t) + (name.capacity() + address.capacity() + email.capacity() + phone.capacity()) * sizeof(PooledStr);
+    }
+};
+
+// Items stored column-wise like CustomerTable, with price and tax rate in
+// plain numeric arrays. Descriptions are interned. Copies of the table share
+// the pool and append to it until compact_pool moves one to a fresh pool, so
+// a copy's strings stay valid while the original grows, but only as long as
+// the copy itself.
+struct ItemTable {
+    vector<int32_t> id;
+    vector<PooledStr> code;
+    vector<PooledStr> description;
+    vector<int64_t> unitPrice;
+    vector<int32_t> taxBp;
+    shared_ptr<StringPool> pool = make_shared<StringPool>();
+    typedef RowIterator<ItemTable, ItemRow> iterator;
+
+    size_t size() const { return id.size(); }
+    bool empty() const { return id.empty(); }
+    void clear() {
+        id.clear();
+        code.clear();
+        description.clear();
+        unitPrice.clear();
+        taxBp.clear();
+        pool = make_shared<StringPool>();
+    }
+    void reserve(size_t n) {
+        id.reserve(n);
+        code.reserve(n);
+        description.reserve(n);
+        unitPrice.reserve(n);
+        taxBp.reserve(n);
+    }
+    void push_back(const ItemRow& it) {
+        id.push_back(it.id);
+        code.push_back(pool->add(it.code));
+        description.push_back(pool->intern(it.description));
+        unitPrice.push_back(it.unitPrice.minor);
+        taxBp.push_back(it.taxBp);
+    }
+    void push_back(const Item& it) { push_back(it.row()); }
+    void set(size_t i, const ItemRow& it) {
+        id[i] = it.id;
+        code[i] = pool->add(it.code);
+        description[i] = pool->intern(it.description);
+        unitPrice[i] = it.unitPrice.minor;
+        taxBp[i] = it.taxBp;
+    }
+    void erase(size_t i) {
+        id.erase(id.begin() + i);
+        code.erase(code.begin() + i);
+        description.erase(description.begin() + i);
+        unitPrice.erase(unitPrice.begin() + i);
+        taxBp.erase(taxBp.begin() + i);
+    }
+    void move_row(size_t dst, size_t src) {
+        id[dst] = id[src];
+        code[dst] = code[src];
+        description[dst] = description[src];
+        unitPrice[dst] = unitPrice[src];
+        taxBp[dst] = taxBp[src];
+    }
+    void resize(size_t n) {
+        id.resize(n);
+        code.resize(n);
+        description.resize(n);
+        unitPrice.resize(n);
+        taxBp.resize(n);
+    }
+    ItemRow operator[](size_t i) const {
+        ItemRow r;
+        r.id = id[i];
+        r.code = code[i].view();
+        r.description = description[i].view();
+        r.unitPrice = Money::cents(unitPrice[i]);
+        r.taxBp = taxBp[i];
+        r.found = true;
+        return r;
+    }
+    // The pool is shared with earlier snapshots, which keep the old one, so
+    // this table moves to a fresh pool holding just its own strings.
+    void compact_pool() {
+        if (!pool->due()) return;
+        size_t live = 0;
+        for (size_t i = 0; i < size(); ++i) live += code[i].footprint() + description[i].footprint();
+        if (!pool->wasteful(live)) return;
+        shared_ptr<StringPool> fresh = make_shared<StringPool>();
+        for (size_t i = 0; i < size(); ++i) {
+            code[i] = fresh->add(code[i].view());
+            description[i] = fresh->intern(description[i].view());
+        }
+        fresh->checkedAt = fresh->bytes;
+        pool = fresh;
+    }
+    // Reorders the rows so that row i is the old row order[i].
+    void permute(const vector<uint32_t>& order) {
+        ItemTable t;
+        t.pool = pool;
+        t.reserve(order.size());
+        for (uint32_t i : order) {
+            t.id.push_back(id[i]);
+            t.code.push_back(code[i]);
+            t.description.push_back(description[i]);
+            t.unitPrice.push_back(unitPrice[i]);
+            t.taxBp.push_back(taxBp[i]);
+        }
+        *this = move(t);
+    }
+    iterator begin() const { return iterator{ this, 0 }; }
+    iterator end() const { return iterator{ this, size() }; }
+    size_t memory() const {
+        return pool->memory() + (id.capacity() + taxBp.capacity()) * sizeof(int32_t) + unitPrice.capacity() * sizeof(int64_t)
+             + (code.capacity() + description.capacity()) * sizeof(PooledStr);
+    }
+};
+
+// One immutable version of the item catalog. Rows are kept in id order so
+// ids are found by binary search, and byCode lists row positions ordered by
+// SKU (equal SKUs in row order, so the first one wins). Neither index needs
+// rehashing when a snapshot is copied for the next version.
+static const uint16_t UNCATEGORIZED = UINT16_MAX;
+
+struct CatalogSnapshot {
+    uint32_t version = 0;
+    ItemTable items;
+    vector<uint32_t> byCode;
+    // TaxEngine category of each row, resolved when the snapshot is
+    // published; edits mark the rows they touch UNCATEGORIZED.
+    vector<uint16_t> taxCategory;
+
+    size_t position(int id) const {
+        auto f = lower_bound(items.id.begin(), items.id.end(), id);
+        return f != items.id.end() && *f == id ? (size_t)(f - items.id.begin()) : string::npos;
+    }
+    size_t position(string_view code) const {
+        auto f = lower_bound(byCode.begin(), byCode.end(), code, [&](uint32_t i, string_view c) { return items.code[i].view() < c; });
+        return f != byCode.end() && items.code[*f].view() == code ? *f : string::npos;
+    }
+    ItemRow find(int id) const {
+        size_t i = position(id);
+        return i == string::npos ? ItemRow() : items[i];
+    }
+    ItemRow find(string_view code) const {
+        size_t i = position(code);
+        return i == string::npos ? ItemRow() : items[i];
+    }
+    // An all-digit key is tried as an id first, then as a SKU.
+    ItemRow resolve(const string& key) const {
+        ItemRow it;
+        bool digits = !key.empty() && key.size() < 10 && all_of(key.begin(), key.end(), ::isdigit);
+        if (digits) it = find(stoi(key));
+        if (!it) it = find(string_view(key));
+        return it;
+    }
+    void index() {
+        vector<uint32_t> order(items.size());
+        for (size_t i = 0; i < order.size(); ++i) order[i] = (uint32_t)i;
+        if (!is_sorted(items.id.begin(), items.id.end())) {
+            stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return items.id[a] < items.id[b]; });
+            items.permute(order);
+            for (size_t i = 0; i < order.size(); ++i) order[i] = (uint32_t)i;
+        }
+        stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return items.code[a].view() < items.code[b].view(); });
+        byCode.swap(order);
+        taxCategory.assign(items.size(), UNCATEGORIZED);
+    }
+    // New rows must carry an id above every existing one.
+    void push_back(const ItemRow& it) {
+        items.push_back(it);
+        taxCategory.push_back(UNCATEGORIZED);
+        string_view code = items.code.back().view();
+        auto f = upper_bound(byCode.begin(), byCode.end(), code, [&](string_view c, uint32_t i) { return c < items.code[i].view(); });
+        byCode.insert(f, (uint32_t)(items.size() - 1));
+    }
+    // The SKU must not change; byCode is not re-sorted.
+    void set(size_t pos, const ItemRow& it) {
+        items.set(pos, it);
+        taxCategory[pos] = UNCATEGORIZED;
+    }
+    void erase(size_t pos) {
+        items.erase(pos);
+        taxCategory.erase(taxCategory.begin() + pos);
+        byCode.erase(std::find(byCode.begin(), byCode.end(), (uint32_t)pos));
+        for (auto& i : byCode) {
+            if (i > pos) --i;
+        }
+    }
+    size_t memory() const { return items.memory() + byCode.capacity() * sizeof(uint32_t) + taxCategory.capacity() * sizeof(uint16_t); }
+};
+
+struct CatalogPublisher;
+struct TaxEngine;
+
+// Holds a snapshot alive for as long as the pin exists.
+struct CatalogPin {
+    CatalogPublisher* owner = nullptr;
+    size_t slot = 0;
+    const CatalogSnapshot* snap = nullptr;
+    CatalogPin() {}
+    CatalogPin(CatalogPin&& o) : owner(o.owner), slot(o.slot), snap(o.snap) { o.owner = nullptr; }
+    CatalogPin(const CatalogPin&) = delete;
+    CatalogPin& operator=(const CatalogPin&) = delete;
+    ~CatalogPin();
+    const CatalogSnapshot* operator->() const { return snap; }
+    const CatalogSnapshot& operator*() const { return *snap; }
+};
+
+// Publishes catalog snapshots RCU-style. A reader pins the current snapshot
+// by storing its pointer in a free hazard slot and then checking that it is
+// still current; it takes no lock. Publishing swaps the current pointer and
+// retires the old snapshot, which is freed once no slot holds it, either on
+// the next publish or when its last reader unpins. Publishes must be
+// serialized by the caller.
+struct CatalogPublisher {
+    static const size_t SLOTS = 256;
+    atomic<const CatalogSnapshot*> current{ nullptr };
+    atomic<const CatalogSnapshot*> slots[SLOTS];
+    atomic<size_t> retiredCount{ 0 };
+    mutex retireLock;
+    vector<const CatalogSnapshot*> retired;
+    const TaxEngine* taxes = nullptr;
+
+    CatalogPublisher() {
+        for (auto& s : slots) s.store(nullptr);
+        current.store(new CatalogSnapshot());
+    }
+    ~CatalogPublisher() {
+        delete current.load();
+        for (auto* s : retired) delete s;
+    }
+    CatalogPin pin() {
+        static atomic<size_t> nextStart{ 0 };
+        thread_local size_t start = nextStart.fetch_add(1) * 7;
+        for (size_t n = 0;; ++n) {
+            size_t i = (start + n) % SLOTS;
+            const CatalogSnapshot* snap = current.load();
+            const CatalogSnapshot* expected = nullptr;
+            if (!slots[i].compare_exchange_strong(expected, snap)) {
+                if (n % SLOTS == SLOTS - 1) this_thread::yield();
+                continue;
+            }
+            if (current.load() != snap) {
+                slots[i].store(nullptr);
+                continue;
+            }
+            CatalogPin p;
+            p.owner = this;
+            p.slot = i;
+            p.snap = snap;
+            return p;
+        }
+    }
+    void unpin(size_t slot) {
+        slots[slot].store(nullptr);
+        if (retiredCount.load() == 0 || !retireLock.try_lock()) return;
+        reclaim_locked();
+        retireLock.unlock();
+    }
+    // The newest snapshot; safe without a pin only on the publishing thread.
+    const CatalogSnapshot& latest() const { return *current.load(); }
+    void publish(CatalogSnapshot* next);
+    // Copy-on-write: edit gets a private copy of the latest snapshot, which
+    // is published under version.
+    template <class F>
+    void update(uint32_t version, F edit) {
+        unique_ptr<CatalogSnapshot> next(new CatalogSnapshot(latest()));
+        next->version = version;
+        edit(*next);
+        next->items.compact_pool();
+        publish(next.release());
+    }
+    void reclaim_locked() {
+        auto live = remove_if(retired.begin(), retired.end(), [&](const CatalogSnapshot* s) {
+            for (auto& slot : slots) {
+                if (slot.load() == s) return false;
+            }
+            delete s;
+            return true;
+        });
+        retired.erase(live, retired.end());
+        retiredCount.store(retired.size());
+    }
+};
+
+inline CatalogPin::~CatalogPin() {
+    if (owner) owner->unpin(slot);
+}
+
+// Output buffer for fixed-width text documents. Column helpers pad like
+// setw() with left/right (never truncating) and numbers are formatted into
+// stack buffers, so rendering into a buffer with enough capacity does not
+// allocate.
+struct TextBuffer {
+    string buf;
+    void clear() { buf.clear(); }
+    void write_to(ostream& os) {
+        os.write(buf.data(), buf.size());
+        buf.clear();
+    }
+    void reserve(size_t n) { buf.reserve(n); }
+    void put(string_view s) { buf.append(s.data(), s.size()); }
+    void put(char ch, size_t n = 1) { buf.append(n, ch); }
+    void put_left(string_view s, size_t width) {
+        put(s);
+        if (s.size() < width) put(' ', width - s.size());
+    }
+    void put_right(string_view s, size_t width) {
+        if (s.size() < width) put(' ', width - s.size());
+        put(s);
+    }
+    static string_view int_text(char* tmp, long long v) {
+        return string_view(tmp, to_chars(tmp, tmp + 24, v).ptr - tmp);
+    }
+    static string_view hundredths_text(char* tmp, int64_t v) {
+        return string_view(tmp, format_hundredths(tmp, v));
+    }
+    void put_int(long long v) {
+        char tmp[24];
+        put(int_text(tmp, v));
+    }
+};
+
+// localtime() and strftime() once per second instead of once per document.
+struct TimestampCache {
+    time_t second = (time_t)-1;
+    char text[32];
+    const char* now() {
+        time_t t = time(nullptr);
+        if (t != second) {
+            second = t;
+            strftime(text, sizeof(text), "%Y-%m-%d %H:%M:%S", localtime(&t));
+        }
+        return text;
+    }
+};
+
+// Bound on the sum of line magnitudes over an invoice. The net and tax sums
+// in sum_lines() and the gross amount in compute_totals() are each at most
+// that sum, or twice it for gross, so none of them can overflow.
+static const int64_t LINE_MAGNITUDE_LIMIT = numeric_limits<int64_t>::max() / 2;
+
+struct InvoiceLine {
+    int itemId;
+    string description;
+    Money unitPrice;
+    int64_t quantity;
+    int32_t taxBp;
+    double quantityValue() const { return (double)quantity / QTY_SCALE; }
+    double taxPercent() const { return (double)taxBp / 100.0; }
+    Money lineAmount() const { return Money::cents(round_div(unitPrice.minor * quantity, QTY_SCALE)); }
+    // |price * quantity| * max(|rate|, 100%), or LINE_MAGNITUDE_LIMIT + 1
+    // when it is larger than the limit.
+    int64_t magnitude() const {
+        int64_t p = unitPrice.minor < 0 ? -unitPrice.minor : unitPrice.minor;
+        int64_t q = quantity < 0 ? -quantity : quantity;
+        int64_t r = max<int64_t>(taxBp < 0 ? -(int64_t)taxBp : taxBp, BP_SCALE);
+        if (p == 0) return 0;
+        return q <= LINE_MAGNITUDE_LIMIT / r / p ? p * q * r : LINE_MAGNITUDE_LIMIT + 1;
+    }
+    bool in_range() const { return magnitude() <= LINE_MAGNITUDE_LIMIT; }
+};
+
+// Invoice lines stored column-wise so totals run as one pass over the
+// numeric arrays.
+struct InvoiceLines {
+    vector<int> itemId;
+    vector<string> description;
+    vector<int64_t> unitPrice;
+    vector<int64_t> quantity;
+    vector<int64_t> taxBp;
+    // Saturating sum of the lines' magnitudes.
+    int64_t magnitude = 0;
+    size_t size() const { return itemId.size(); }
+    bool empty() const { return itemId.empty(); }
+    // Whether L can be added without the invoice's sums overflowing. Rates
+    // set later by the tax engine are at most 100%, so they keep this bound.
+    bool fits(const InvoiceLine& L) const { return L.in_range() && L.magnitude() <= LINE_MAGNITUDE_LIMIT - magnitude; }
+    void clear() {
+        magnitude = 0;
+        itemId.clear();
+        description.clear();
+        unitPrice.clear();
+        quantity.clear();
+        taxBp.clear();
+    }
+    void reserve(size_t n) {
+        itemId.reserve(n);
+        description.reserve(n);
+        unitPrice.reserve(n);
+        quantity.reserve(n);
+        taxBp.reserve(n);
+    }
+    void push_back(const InvoiceLine& L) {
+        int64_t m = L.magnitude();
+        magnitude = m <= LINE_MAGNITUDE_LIMIT - magnitude ? magnitude + m : LINE_MAGNITUDE_LIMIT + 1;
+        itemId.push_back(L.itemId);
+        description.push_back(L.description);
+        unitPrice.push_back(L.unitPrice.minor);
+        quantity.push_back(L.quantity);
+        taxBp.push_back(L.taxBp);
+    }
+    InvoiceLine operator[](size_t i) const {
+        InvoiceLine L;
+        L.itemId = itemId[i];
+        L.description = description[i];
+        L.unitPrice = Money::cents(unitPrice[i]);
+        L.quantity = quantity[i];
+        L.taxBp = (int32_t)taxBp[i];
+        return L;
+    }
+};
+
+// Exact line sums: net in 1/QTY_SCALE cents, tax in 1/(QTY_SCALE*BP_SCALE)
+// cents. Four independent accumulators keep the loop free of a serial
+// dependency so the compiler can vectorise it.
+struct LineSums {
+    int64_t net;
+    int64_t tax;
+};
+
+LineSums sum_lines(const int64_t* price, const int64_t* qty, const int64_t* bp, size_t n) {
+    int64_t net[4] = { 0, 0, 0, 0 };
+    int64_t tax[4] = { 0, 0, 0, 0 };
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        for (size_t k = 0; k < 4; ++k) {
+            int64_t a = price[i + k] * qty[i + k];
+            net[k] += a;
+            tax[k] += a * bp[i + k];
+        }
+    }
+    for (; i < n; ++i) {
+        int64_t a = price[i] * qty[i];
+        net[0] += a;
+        tax[0] += a * bp[i];
+    }
+    LineSums r = { net[0] + net[1] + net[2] + net[3], tax[0] + tax[1] + tax[2] + tax[3] };
+    return r;
+}
+
+struct InvoiceTotals {
+    Money subtotal;
+    Money tax;
+    Money discount;
+    Money total;
+};
+
+InvoiceTotals compute_totals(const InvoiceLines& lines, int32_t discountBp, Money shipping) {
+    LineSums s = sum_lines(lines.unitPrice.data(), lines.quantity.data(), lines.taxBp.data(), lines.size());
+    const int64_t exact = QTY_SCALE * BP_SCALE;
+    int64_t gross = s.net * BP_SCALE + s.tax;
+    InvoiceTotals t;
+    t.subtotal = Money::cents(round_div(s.net, QTY_SCALE));
+    t.tax = Money::cents(round_div(s.tax, exact));
+    t.discount = Money::cents(mul_div_round(gross, discountBp, exact * BP_SCALE));
+    t.total = Money::cents(mul_div_round(gross, BP_SCALE - discountBp, exact * BP_SCALE)) + shipping;
+    return t;
+}
+
+// Tax rules from tax_rules.csv, one per row:
+//   category,<name>,<SKU prefix>    items whose SKU starts with the prefix
+//   region,<name>,<address suffix>  customers whose address ends with it
+//   rate,<category or *>,<region or *>,<tax>,<from YYYY-MM-DD>,<percent>[,compound]
+// For each tax the matching rate row with the most specific category and
+// region wins, then the latest one in effect; a compound tax applies to the
+// price plus the taxes listed before it. The rules are compiled once into a
+// flat table of combined rates by (date segment, region, category). Lines
+// carry a single rate in basis points, so a stack of taxes is folded into
+// its equivalent rate, rounded to the basis point. Lines no rule covers keep
+// their item's rate.
+struct TaxEngine {
+    // Per (segment, region) row: every line keeps its item rate, every line
+    // gets one rate, or the rate depends on the item's category.
+    enum RowShape : uint8_t { ROW_ITEM_RATES, ROW_FLAT, ROW_BY_CATEGORY };
+    static const int64_t RATE_SCALE = 1000000;
+
+    struct RateRule {
+        uint16_t category;
+        uint16_t region;
+        uint16_t tax;
+        bool compound;
+        int32_t from;
+        int64_t rate;
+    };
+    // Index 0 is "*" in rules and "no match" for an item or customer.
+    vector<string> categories{ "*" };
+    vector<string> regions{ "*" };
+    vector<string> taxes;
+    vector<pair<string, uint16_t>> prefixes;
+    vector<pair<string, uint16_t>> suffixes;
+    unordered_map<string_view, uint16_t> byPrefix;
+    vector<size_t> prefixLengths;
+    vector<RateRule> rules;
+    vector<int32_t> segmentStarts;
+    vector<int32_t> rates;
+    vector<uint8_t> shapes;
+
+    // byPrefix points into prefixes, and published snapshots hold a pointer
+    // to the engine that categorized them.
+    TaxEngine() {}
+    TaxEngine(const TaxEngine&) = delete;
+    TaxEngine(TaxEngine&&) = delete;
+    TaxEngine& operator=(const TaxEngine&) = delete;
+    TaxEngine& operator=(TaxEngine&&) = delete;
+    bool empty() const { return rates.empty(); }
+    static uint16_t index_of(vector<string>& names, string_view name, bool add) {
+        for (size_t i = 0; i < names.size(); ++i) {
+            if (names[i] == name) return (uint16_t)i;
+        }
+        if (!add) return UINT16_MAX;
+        names.emplace_back(name);
+        return (uint16_t)(names.size() - 1);
+    }
+    size_t segment(int dateKey) const {
+        return upper_bound(segmentStarts.begin(), segmentStarts.end(), dateKey) - segmentStarts.begin();
+    }
+    uint16_t region(string_view address) const {
+        for (auto& s : suffixes) {
+            if (address.size() >= s.first.size() && address.substr(address.size() - s.first.size()) == s.first) return s.second;
+        }
+        return 0;
+    }
+    uint16_t category(string_view sku) const {
+        for (size_t len : prefixLengths) {
+            if (sku.size() < len) continue;
+            auto f = byPrefix.find(sku.substr(0, len));
+            if (f != byPrefix.end()) return f->second;
+        }
+        return 0;
+    }
+    // Rows are validated as a whole before anything is compiled, so names
+    // may be used before the row that defines them.
+    void compile(const char* begin, const char* end, vector<CsvReject>& rejects) {
+        vector<pair<size_t, vector<string>>> rows;
+        CsvParser ps(begin, end);
+        while (ps.next()) {
+            if (ps.error) { rejects.push_back(CsvReject{ ps.recordLine, "malformed CSV" }); continue; }
+            if (ps.fields[0].empty() || ps.fields[0][0] == '#') continue;
+            rows.emplace_back(ps.recordLine, vector<string>(ps.fields.begin(), ps.fields.end()));
+        }
+        for (auto& row : rows) {
+            const vector<string>& f = row.second;
+            bool named = f.size() == 3 && !f[1].empty() && f[1] != "*" && !f[2].empty();
+            if (f[0] == "category" && named) prefixes.emplace_back(f[2], index_of(categories, f[1], true));
+            else if (f[0] == "region" && named) suffixes.emplace_back(f[2], index_of(regions, f[1], true));
+            else if (f[0] == "category" || f[0] == "region") rejects.push_back(CsvReject{ row.first, "expected " + f[0] + ",name,match" });
+        }
+        for (auto& row : rows) {
+            const vector<string>& f = row.second;
+            if (f[0] != "rate") {
+                if (f[0] != "category" && f[0] != "region") rejects.push_back(CsvReject{ row.first, "unknown rule type " + f[0] });
+                continue;
+            }
+            RateRule r;
+            const char* problem = nullptr;
+            if (f.size() != 6 && f.size() != 7) problem = "expected rate,category,region,tax,from,percent[,compound]";
+            else if ((r.category = index_of(categories, f[1], false)) == UINT16_MAX) problem = "unknown category";
+            else if ((r.region = index_of(regions, f[2], false)) == UINT16_MAX) problem = "unknown region";
+            else if (f[3].empty()) problem = "empty tax name";
+            else if ((r.from = date_key(f[4])) < 0) problem = "invalid date, use YYYY-MM-DD";
+            else if (!parse_decimal(f[5], RATE_SCALE / 100, r.rate) || r.rate < 0 || r.rate > RATE_SCALE) problem = "percent must be 0 to 100";
+            else if (f.size() == 7 && f[6] != "compound" && !f[6].empty()) problem = "last field must be compound or empty";
+            if (problem) { rejects.push_back(CsvReject{ row.first, problem }); continue; }
+            r.tax = index_of(taxes, f[3], true);
+            r.compound = f.size() == 7 && f[6] == "compound";
+            rules.push_back(r);
+            segmentStarts.push_back(r.from);
+        }
+        sort(segmentStarts.begin(), segmentStarts.end());
+        segmentStarts.erase(unique(segmentStarts.begin(), segmentStarts.end()), segmentStarts.end());
+        sort(suffixes.begin(), suffixes.end(), [](const pair<string, uint16_t>& a, const pair<string, uint16_t>& b) { return a.first.size() > b.first.size(); });
+        for (auto& p : prefixes) {
+            if (byPrefix.insert(make_pair(string_view(p.first), p.second)).second) prefixLengths.push_back(p.first.size());
+        }
+        sort(prefixLengths.rbegin(), prefixLengths.rend());
+        prefixLengths.erase(unique(prefixLengths.begin(), prefixLengths.end()), prefixLengths.end());
+        if (rules.empty()) return;
+        size_t nCat = categories.size(), nReg = regions.size(), nSeg = segmentStarts.size() + 1;
+        rates.assign(nSeg * nReg * nCat, -1);
+        shapes.assign(nSeg * nReg, ROW_ITEM_RATES);
+        vector<const RateRule*> best(taxes.size());
+        for (size_t seg = 1; seg < nSeg; ++seg) {
+            for (size_t reg = 0; reg < nReg; ++reg) {
+                int32_t* row = &rates[(seg * nReg + reg) * nCat];
+                for (size_t cat = 0; cat < nCat; ++cat) row[cat] = combined_rate(segmentStarts[seg - 1], (uint16_t)reg, (uint16_t)cat, best);
+                bool uniform = all_of(row, row + nCat, [&](int32_t r) { return r == row[0]; });
+                shapes[seg * nReg + reg] = !uniform ? ROW_BY_CATEGORY : row[0] < 0 ? ROW_ITEM_RATES : ROW_FLAT;
+            }
+        }
+    }
+    int32_t combined_rate(int32_t date, uint16_t reg, uint16_t cat, vector<const RateRule*>& best) const {
+        auto rank = [](const RateRule& r) { return (r.category ? 2 : 0) + (r.region ? 1 : 0); };
+        fill(best.begin(), best.end(), nullptr);
+        for (auto& r : rules) {
+            if (r.from > date || (r.category && r.category != cat) || (r.region && r.region != reg)) continue;
+            const RateRule*& b = best[r.tax];
+            if (!b || rank(r) > rank(*b) || (rank(r) == rank(*b) && r.from >= b->from)) b = &r;
+        }
+        bool any = false;
+        int64_t total = 0;
+        for (const RateRule* b : best) {
+            if (!b) continue;
+            any = true;
+            total += b->compound ? round_div((RATE_SCALE + total) * b->rate, RATE_SCALE) : b->rate;
+        }
+        return any ? (int32_t)min<int64_t>(round_div(total, RATE_SCALE / BP_SCALE), BP_SCALE) : -1;
+    }
+    // Resolves the rows of s still marked UNCATEGORIZED.
+    void categorize(CatalogSnapshot& s) const {
+        if (s.taxCategory.size() != s.items.size()) s.taxCategory.assign(s.items.size(), UNCATEGORIZED);
+        for (size_t i = 0; i < s.items.size(); ++i) {
+            if (s.taxCategory[i] == UNCATEGORIZED) s.taxCategory[i] = category(s.items.code[i].view());
+        }
+    }
+    bool load(const string& path) {
+        MappedFile mf;
+        if (!mf.open(path)) return false;
+        vector<CsvReject> rejects;
+        compile(mf.data, mf.data + mf.size, rejects);
+        for (auto& r : rejects) cout << "Warning: " << path << ":" << r.line << ": " << r.reason << "\n";
+        return true;
+    }
+    // Sets the rate of every line of an invoice dated dateKey for a customer
+    // at address. Lines are resolved in one pass with the loop for the row's
+    // shape chosen at compile time. catalog must have been categorized by
+    // this engine.
+    void apply(InvoiceLines& lines, const CatalogSnapshot& catalog, string_view address, int dateKey) const {
+        if (empty()) return;
+        size_t row = segment(dateKey) * regions.size() + region(address);
+        const int32_t* r = &rates[row * categories.size()];
+        if (shapes[row] == ROW_FLAT) apply_row<ROW_FLAT>(r, lines, catalog);
+        else if (shapes[row] == ROW_BY_CATEGORY) apply_row<ROW_BY_CATEGORY>(r, lines, catalog);
+    }
+    template <RowShape Shape>
+    void apply_row(const int32_t* row, InvoiceLines& lines, const CatalogSnapshot& catalog) const {
+        int64_t* bp = lines.taxBp.data();
+        if (Shape == ROW_FLAT) {
+            fill(bp, bp + lines.size(), (int64_t)row[0]);
+            return;
+        }
+        for (size_t i = 0; i < lines.size(); ++i) {
+            size_t pos = catalog.position(lines.itemId[i]);
+            int32_t rate = row[pos == string::npos ? 0 : catalog.taxCategory[pos]];
+            if (rate >= 0) bp[i] = rate;
+        }
+    }
+};
+
+inline void CatalogPublisher::publish(CatalogSnapshot* next) {
+    if (taxes) taxes->categorize(*next);
+    const CatalogSnapshot* old = current.exchange(next);
+    retiredCount.fetch_add(1);
+    lock_guard<mutex> g(retireLock);
+    retired.push_back(old);
+    reclaim_locked();
+}
+
+struct Invoice {
+    int id;
+    int customerId;
+    string date;
+    string note;
+    InvoiceLines lines;
+    int32_t discountBp;
+    Money shipping;
+    uint32_t catalogVersion = 0;
+    double discountPercent() const { return (double)discountBp / 100.0; }
+    InvoiceTotals totals() const { return compute_totals(lines, discountBp, shipping); }
+    // Layout matches the original stream-based renderer byte for byte,
+    // including its quirk of printing the first quantity in default float
+    // format and every later one with two decimals.
+    void render_txt(const CustomerRow& c, TextBuffer& out, const char* generated) const {
+        char tmp[32];
+        char qbuf[32];
+        out.reserve(out.buf.size() + 1024 + lines.size() * 96 + note.size());
+        out.put_left("BILLING SYSTEM", 40);
+        out.put_right("INVOICE #", 30);
+        out.put_int(id);
+        out.put('\n');
+        out.put_left("Date: ", 50); out.put(date); out.put('\n');
+        out.put_left("Customer: ", 50); out.put(c.name); out.put('\n');
+        out.put_left("Address: ", 50); out.put(c.address); out.put('\n');
+        out.put_left("Email: ", 50); out.put(c.email); out.put('\n');
+        out.put_left("Phone: ", 50); out.put(c.phone); out.put("\n\n");
+        out.put_left("No", 6);
+        out.put_left("Qty", 8);
+        out.put_left("Unit", 10);
+        out.put_left("Description", 40);
+        out.put_left("Tax%", 10);
+        out.put_left("LineTotal", 14);
+        out.put('\n');
+        out.put('-', 90);
+        out.put('\n');
+        for (size_t i = 0; i < lines.size(); ++i) {
+            int64_t q = lines.quantity[i];
+            string_view qty;
+            if (i == 0) qty = string_view(qbuf, snprintf(qbuf, sizeof(qbuf), "%g", (double)q / QTY_SCALE));
+            else if (q % 10 != 0) qty = string_view(qbuf, snprintf(qbuf, sizeof(qbuf), "%.2f", (double)q / QTY_SCALE));
+            else qty = TextBuffer::hundredths_text(qbuf, q / 10);
+            out.put_left(TextBuffer::int_text(tmp, (long long)i + 1), 6);
+            out.put_left(qty, 8);
+            out.put_left(TextBuffer::hundredths_text(tmp, lines.unitPrice[i]), 10);
+            out.put_left(lines.description[i], 40);
+            out.put_left(TextBuffer::hundredths_text(tmp, lines.taxBp[i]), 10);
+            out.put_left(TextBuffer::hundredths_text(tmp, round_div(lines.unitPrice[i] * q, QTY_SCALE)), 14);
+            out.put('\n');
+        }
+        InvoiceTotals t = totals();
+        out.put('-', 90);
+        out.put('\n');
+        out.put_right("Subtotal: ", 70); out.put_right(TextBuffer::hundredths_text(tmp, t.subtotal.minor), 14); out.put('\n');
+        out.put_right("Tax: ", 70); out.put_right(TextBuffer::hundredths_text(tmp, t.tax.minor), 14); out.put('\n');
+        out.put_right("Discount (", 70);
+        out.put(TextBuffer::hundredths_text(tmp, discountBp));
+        out.put("%): ");
+        int64_t d = t.discount.minor;
+        char* dp = tmp;
+        if (d >= 0) *dp++ = '-';
+        dp += format_hundredths(dp, d >= 0 ? d : -d);
+        out.put_right(string_view(tmp, dp - tmp), 14); out.put('\n');
+        out.put_right("Shipping: ", 70); out.put_right(TextBuffer::hundredths_text(tmp, shipping.minor), 14); out.put('\n');
+        out.put_right("TOTAL: ", 70); out.put_right(TextBuffer::hundredths_text(tmp, t.total.minor), 14); out.put("\n\n");
+        out.put("Note: "); out.put(note); out.put('\n');
+        out.put("Generated: "); out.put(generated); out.put('\n');
+    }
+    string to_txt(const CustomerRow& c) const {
+        TextBuffer out;
+        render_txt(c, out, now_datetime().c_str());
+        return out.buf;
+    }
+    string meta_csv() const {
+        stringstream ss;
+        ss << id << "," << customerId << "," << date << "," << format_hundredths(discountBp) << "," << shipping.str() << "," << catalogVersion;
+        return ss.str();
+    }
+};
+
+// Reusable renderer for bulk document generation: one buffer and one cached
+// timestamp shared across invoices.
+struct InvoiceRenderer {
+    TextBuffer out;
+    TimestampCache clock;
+    const string& render(const Invoice& inv, const CustomerRow& c) {
+        out.clear();
+        inv.render_txt(c, out, clock.now());
+        return out.buf;
+    }
+};
+
+static const uint32_t LEDGER_MAGIC = 0x47444C42;
+static const uint32_t LEDGER_VERSION = 2;
+static const uint32_t SNAPSHOT_MAGIC = 0x50534E42;
+static const uint32_t SNAPSHOT_VERSION = 5;
+
+struct LedgerRecordHeader {
+    int64_t shipping;
+    int64_t subtotal;
+    int64_t tax;
+    int64_t discount;
+    int64_t total;
+    int32_t id;
+    int32_t customerId;
+    int32_t date;
+    int32_t discountBp;
+    uint32_t lineCount;
+    uint32_t noteLen;
+    uint32_t recordSize;
+    uint32_t catalogVersion;
+};
+
+struct LedgerLineRecord {
+    int64_t unitPrice;
+    int64_t quantity;
+    int32_t taxBp;
+    int32_t itemId;
+    uint32_t descLen;
+    uint32_t reserved;
+};
+
+struct LedgerIndexEntry {
+    int32_t date;
+    int32_t id;
+    int32_t customerId;
+    uint32_t recordSize;
+    uint64_t offset;
+    bool operator<(const LedgerIndexEntry& o) const {
+        return date != o.date ? date < o.date : id < o.id;
+    }
+};
+
+static_assert(sizeof(LedgerRecordHeader) == 72, "ledger header layout");
+static_assert(sizeof(LedgerLineRecord) == 32, "ledger line layout");
+static_assert(sizeof(LedgerIndexEntry) == 24, "ledger index layout");
+
+// Binary ledger of saved invoices: one record per invoice with precomputed
+// totals, plus an index kept sorted by (date, id) so date-range reports are a
+// binary search followed by a forward scan. Records are appended to the ledger
+// first and to the index second; load() re-indexes any tail the index missed.
+// Appends from any thread are queued per file and written by one committer
+// thread: each commit is a single write and a single data sync per touched
+// file, shared by every caller queued at that point. append() returns a
+// ticket; wait(ticket) blocks until that append (and all before it) is on
+// disk. A nonzero window holds a commit open to collect more callers,
+// trading latency for fewer syncs; maxBatch closes it early. A failed
+// write or sync is sticky and fails every later wait.
+// A commit that fails to write or sync a file truncates it back to its last
+// good length and keeps the data queued, so every offset callers were given
+// stays valid; the data is retried with the next commit, or after
+// WRITE_RETRY_DELAY when nothing else arrives. wait() reports whether the
+// commit that carried a ticket succeeded, and a later commit that succeeds
+// makes the retried data durable too.
+static const chrono::milliseconds WRITE_RETRY_DELAY(1000);
+
+struct GroupCommitWriter {
+    struct Target {
+        int fd = -1;
+        int64_t size = 0;
+        int64_t disk = 0;
+        string pending;
+        bool busy = false;
+    };
+    struct Pending {
+        Target* target;
+        int fd;
+        int64_t disk;
+        string data;
+        bool ok;
+    };
+    mutex lock;
+    condition_variable work;
+    condition_variable done;
+    map<string, Target> targets;
+    uint64_t queued = 0;
+    uint64_t taken = 0;
+    uint64_t attempted = 0;
+    uint64_t durable = 0;
+    uint64_t commits = 0;
+    size_t pendingRecords = 0;
+    chrono::steady_clock::time_point firstPending;
+    chrono::microseconds window{ 0 };
+    size_t maxBatch = 1024;
+    bool syncWrites = true;
+    bool failed = false;
+    bool stopping = false;
+    thread committer;
+
+    GroupCommitWriter() : committer([this] { run(); }) {}
+    GroupCommitWriter(const GroupCommitWriter&) = delete;
+    GroupCommitWriter& operator=(const GroupCommitWriter&) = delete;
+    ~GroupCommitWriter() {
+        {
+            lock_guard<mutex> g(lock);
+            stopping = true;
+        }
+        work.notify_all();
+        committer.join();
+        for (auto& t : targets) close_fd(t.second.fd);
+    }
+
+#ifdef _WIN32
+    static int open_fd(const string& path) { return _open(path.c_str(), _O_WRONLY | _O_APPEND | _O_CREAT | _O_BINARY, _S_IREAD | _S_IWRITE); }
+    static int64_t end_of(int fd) { return _lseeki64(fd, 0, SEEK_END); }
+    static bool sync_fd(int fd) { return _commit(fd) == 0; }
+    static void truncate_fd(int fd, int64_t size) { _chsize_s(fd, size); }
+    static void close_fd(int fd) { if (fd >= 0) _close(fd); }
+    static bool write_fd(int fd, const string& data) {
+        for (size_t done = 0; done < data.size();) {
+            int n = _write(fd, data.data() + done, (unsigned)min<size_t>(data.size() - done, 1 << 30));
+            if (n <= 0) return false;
+            done += (size_t)n;
+        }
+        return true;
+    }
+#else
+    static int open_fd(const string& path) { return ::open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644); }
+    static int64_t end_of(int fd) { return (int64_t)lseek(fd, 0, SEEK_END); }
+#ifdef __APPLE__
+    static bool sync_fd(int fd) { return fsync(fd) == 0; }
+#else
+    static bool sync_fd(int fd) { return fdatasync(fd) == 0; }
+#endif
+    static void truncate_fd(int fd, int64_t size) {
+        while (ftruncate(fd, (off_t)size) != 0 && errno == EINTR) {}
+    }
+    static void close_fd(int fd) { if (fd >= 0) ::close(fd); }
+    static bool write_fd(int fd, const string& data) {
+        for (size_t done = 0; done < data.size();) {
+            ssize_t n = ::write(fd, data.data() + done, data.size() - done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            done += (size_t)n;
+        }
+        return true;
+    }
+#endif
+
+    void configure(long long windowUs, long long batch, bool sync) {
+        lock_guard<mutex> g(lock);
+        window = chrono::microseconds(max(0LL, windowUs));
+        maxBatch = (size_t)max(1LL, batch);
+        syncWrites = sync;
+    }
+    Target& target(const string& path) {
+        Target& t = targets[path];
+        if (t.fd < 0) {
+            t.fd = open_fd(path);
+            t.disk = t.fd < 0 ? 0 : end_of(t.fd);
+            t.size = t.disk + (int64_t)t.pending.size();
+            STATS_ADD(CTR_FILES_OPENED, 1);
+        }
+        return t;
+    }
+    uint64_t append(const string& path, const char* data, size_t n) {
+        lock_guard<mutex> g(lock);
+        Target& t = target(path);
+        t.pending.append(data, n);
+        t.size += (int64_t)n;
+        if (pendingRecords++ == 0) firstPending = chrono::steady_clock::now();
+        uint64_t ticket = ++queued;
+        work.notify_one();
+        return ticket;
+    }
+    uint64_t append(const string& path, const string& data) { return append(path, data.data(), data.size()); }
+    // Bytes on disk plus bytes queued for path.
+    int64_t size(const string& path) {
+        lock_guard<mutex> g(lock);
+        return target(path).size;
+    }
+    bool wait(uint64_t ticket) {
+        unique_lock<mutex> g(lock);
+        done.wait(g, [&] { return attempted >= ticket; });
+        return durable >= ticket;
+    }
+    // Waits for everything queued; after a failure this waits for the next
+    // retry rather than reporting the old result.
+    bool sync() {
+        unique_lock<mutex> g(lock);
+        uint64_t ticket = queued, after = commits;
+        done.wait(g, [&] { return attempted >= ticket && (!failed || commits > after); });
+        return durable >= ticket;
+    }
+    // Once everything queued for path is durable, drops its descriptor and
+    // runs rewrite with the writer still locked, so an append from another
+    // thread waits and goes to the new file instead of being lost with the
+    // old one. rewrite must not use the writer. Returns false, keeping the
+    // descriptor and its queued data, if the queued data cannot be written.
+    // Waits until the first end bytes of path are on disk, for readers that
+    // found data through an index published before its commit. Returns
+    // false if a commit fails first.
+    bool written(const string& path, int64_t end) {
+        unique_lock<mutex> g(lock);
+        uint64_t after = commits;
+        auto on_disk = [&] {
+            auto f = targets.find(path);
+            return f == targets.end() || f->second.disk >= end;
+        };
+        done.wait(g, [&] { return on_disk() || (failed && commits > after); });
+        return on_disk();
+    }
+    template <class F>
+    bool replace(const string& path, F rewrite) {
+        unique_lock<mutex> g(lock);
+        uint64_t after = commits;
+        auto idle = [&] {
+            auto f = targets.find(path);
+            return f == targets.end() || (f->second.pending.empty() && !f->second.busy);
+        };
+        done.wait(g, [&] { return idle() || (failed && commits > after); });
+        if (!idle()) return false;
+        auto f = targets.find(path);
+        if (f != targets.end()) {
+            close_fd(f->second.fd);
+            targets.erase(f);
+        }
+        return rewrite();
+    }
+    void run() {
+        unique_lock<mutex> g(lock);
+        for (;;) {
+            work.wait(g, [&] { return stopping || queued > taken || failed; });
+            if (queued == taken && !failed) return;
+            if (queued == taken && !stopping) {
+                work.wait_for(g, WRITE_RETRY_DELAY, [&] { return stopping || queued > taken; });
+            } else if (window.count() > 0 && !stopping) {
+                work.wait_until(g, firstPending + window, [&] { return stopping || pendingRecords >= maxBatch; });
+            }
+            vector<Pending> batch;
+            for (auto& t : targets) {
+                if (t.second.pending.empty()) continue;
+                if (t.second.fd < 0) {
+                    t.second.fd = open_fd(t.first);
+                    t.second.disk = t.second.fd < 0 ? 0 : end_of(t.second.fd);
+                }
+                batch.push_back(Pending{ &t.second, t.second.fd, t.second.disk, string(), true });
+                batch.back().data.swap(t.second.pending);
+                t.second.busy = true;
+            }
+            uint64_t upTo = taken = queued;
+            pendingRecords = 0;
+            bool sync = syncWrites;
+            g.unlock();
+            bool good = true;
+            {
+                STATS_TIMER(OP_GROUP_COMMIT);
+                for (auto& b : batch) {
+                    b.ok = b.fd >= 0 && write_fd(b.fd, b.data);
+                    STATS_ADD(CTR_BYTES_WRITTEN, b.data.size());
+                }
+                for (auto& b : batch) {
+                    if (!sync || !b.ok) continue;
+                    b.ok = sync_fd(b.fd);
+                    STATS_ADD(CTR_FSYNCS, 1);
+                }
+                for (auto& b : batch) {
+                    if (!b.ok && b.fd >= 0) truncate_fd(b.fd, b.disk);
+                    good = good && b.ok;
+                }
+            }
+            g.lock();
+            for (auto& b : batch) {
+                if (b.ok) b.target->disk += (int64_t)b.data.size();
+                else b.target->pending.insert(0, b.data);
+                b.target->busy = false;
+            }
+            if (good) durable = upTo;
+            failed = !good;
+            attempted = upTo;
+            ++commits;
+            done.notify_all();
+            if (!good && stopping) return;
+        }
+    }
+};
+
+struct InvoiceLedger {
+    vector<LedgerIndexEntry> index;
+    uint64_t ledgerSize = 0;
+    GroupCommitWriter* writer = nullptr;
+
+    static bool read_file_header(istream& in) {
+        uint32_t hdr[2];
+        if (!in.read((char*)hdr, sizeof(hdr))) return false;
+        return hdr[0] == LEDGER_MAGIC && hdr[1] == LEDGER_VERSION;
+    }
+    static string file_header() {
+        uint32_t hdr[2] = { LEDGER_MAGIC, LEDGER_VERSION };
+        return string((const char*)hdr, sizeof(hdr));
+    }
+    static void write_file_header(ostream& out) { out << file_header(); }
+    // The index gains a record when it is queued, not when it is committed,
+    // so readers of the file wait for the queued bytes first.
+    void wait_written() const {
+        if (writer) writer->written(INVOICE_LEDGER_FILE, (int64_t)ledgerSize);
+    }
+    // Version 1 ledgers stored amounts as doubles; rewrite them in place with
+    // minor-unit integers the first time they are opened.
+    static void upgrade_v1() {
+        struct HeaderV1 { double discountPercent, shipping, subtotal, tax, discount, total; int32_t id, customerId, date; uint32_t lineCount, noteLen, recordSize; };
+        struct LineV1 { double unitPrice, quantity, taxPercent; int32_t itemId; uint32_t descLen; };
+        MappedFile mf;
+        if (!mf.open(INVOICE_LEDGER_FILE)) return;
+        BinaryWriter w;
+        w.put_u32(LEDGER_MAGIC);
+        w.put_u32(LEDGER_VERSION);
+        BinaryReader r(mf.data + 2 * sizeof(uint32_t), mf.size - 2 * sizeof(uint32_t));
+        HeaderV1 o;
+        while (r.take(&o, sizeof(o))) {
+            LedgerRecordHeader h;
+            memset(&h, 0, sizeof(h));
+            h.shipping = scale_double(o.shipping, 100);
+            h.subtotal = scale_double(o.subtotal, 100);
+            h.tax = scale_double(o.tax, 100);
+            h.discount = scale_double(o.discount, 100);
+            h.total = scale_double(o.total, 100);
+            h.id = o.id;
+            h.customerId = o.customerId;
+            h.date = o.date;
+            h.discountBp = (int32_t)scale_double(o.discountPercent, 100);
+            h.lineCount = o.lineCount;
+            h.noteLen = o.noteLen;
+            string body(o.noteLen, '\0');
+            r.take(&body[0], o.noteLen);
+            for (uint32_t i = 0; i < o.lineCount && r.ok; ++i) {
+                LineV1 ol;
+                r.take(&ol, sizeof(ol));
+                LedgerLineRecord l;
+                memset(&l, 0, sizeof(l));
+                l.unitPrice = scale_double(ol.unitPrice, 100);
+                l.quantity = scale_double(ol.quantity, QTY_SCALE);
+                l.taxBp = (int32_t)scale_double(ol.taxPercent, 100);
+                l.itemId = ol.itemId;
+                l.descLen = ol.descLen;
+                body.append((const char*)&l, sizeof(l));
+                string desc(ol.descLen, '\0');
+                r.take(&desc[0], ol.descLen);
+                body += desc;
+            }
+            if (!r.ok) break;
+            h.recordSize = (uint32_t)(sizeof(h) + body.size());
+            w.buf.append((const char*)&h, sizeof(h));
+            w.buf += body;
+        }
+        mf.close();
+        if (write_file_atomic(INVOICE_LEDGER_FILE, w.buf)) remove(INVOICE_LEDGER_INDEX_FILE.c_str());
+    }
+    void load() {
+        STATS_TIMER(OP_LEDGER_LOAD);
+        index.clear();
+        ledgerSize = 0;
+        {
+            ifstream probe(INVOICE_LEDGER_FILE.c_str(), ios::binary);
+            uint32_t hdr[2];
+            if (probe.read((char*)hdr, sizeof(hdr)) && hdr[0] == LEDGER_MAGIC && hdr[1] == 1) {
+                probe.close();
+                upgrade_v1();
+            }
+        }
+        ifstream lf(INVOICE_LEDGER_FILE.c_str(), ios::binary | ios::ate);
+        if (!lf) return;
+        ledgerSize = (uint64_t)lf.tellg();
+        uint64_t indexedEnd = 2 * sizeof(uint32_t);
+        ifstream xf(INVOICE_LEDGER_INDEX_FILE.c_str(), ios::binary | ios::ate);
+        STATS_ADD(CTR_FILES_OPENED, 2);
+        if (xf) {
+            size_t bytes = (size_t)xf.tellg();
+            STATS_ADD(CTR_BYTES_READ, bytes);
+            xf.seekg(0);
+            if (bytes >= 2 * sizeof(uint32_t) && read_file_header(xf)) {
+                index.resize((bytes - 2 * sizeof(uint32_t)) / sizeof(LedgerIndexEntry));
+                if (!index.empty()) xf.read((char*)index.data(), index.size() * sizeof(LedgerIndexEntry));
+            }
+        }
+        auto past = remove_if(index.begin(), index.end(), [&](const LedgerIndexEntry& e) { return e.offset + e.recordSize > ledgerSize; });
+        index.erase(past, index.end());
+        for (auto& e : index) indexedEnd = max(indexedEnd, e.offset + e.recordSize);
+        if (indexedEnd < ledgerSize) {
+            ofstream xo;
+            bool fresh = index.empty();
+            xo.open(INVOICE_LEDGER_INDEX_FILE.c_str(), ios::binary | (fresh ? ios::trunc : ios::app));
+            if (fresh) write_file_header(xo);
+            lf.seekg(indexedEnd);
+            uint64_t off = indexedEnd;
+            LedgerRecordHeader h;
+            while (off + sizeof(h) <= ledgerSize && lf.read((char*)&h, sizeof(h))) {
+                if (h.recordSize < sizeof(h) || off + h.recordSize > ledgerSize) break;
+                LedgerIndexEntry e = { h.date, h.id, h.customerId, h.recordSize, off };
+                index.push_back(e);
+                xo.write((const char*)&e, sizeof(e));
+                STATS_ADD(CTR_RECORDS_SCANNED, 1);
+                off += h.recordSize;
+                lf.seekg(off);
+            }
+            ledgerSize = off;
+        }
+        if (!is_sorted(index.begin(), index.end())) sort(index.begin(), index.end());
+    }
+    static string encode(const Invoice& inv, const InvoiceTotals& t) {
+        LedgerRecordHeader h;
+        memset(&h, 0, sizeof(h));
+        h.shipping = inv.shipping.minor;
+        h.subtotal = t.subtotal.minor;
+        h.tax = t.tax.minor;
+        h.discount = t.discount.minor;
+        h.total = t.total.minor;
+        h.discountBp = inv.discountBp;
+        h.id = inv.id;
+        h.customerId = inv.customerId;
+        h.date = date_key(inv.date);
+        h.lineCount = (uint32_t)inv.lines.size();
+        h.noteLen = (uint32_t)inv.note.size();
+        h.catalogVersion = inv.catalogVersion;
+        const InvoiceLines& lines = inv.lines;
+        size_t size = sizeof(h) + inv.note.size();
+        for (auto& d : lines.description) size += sizeof(LedgerLineRecord) + d.size();
+        h.recordSize = (uint32_t)size;
+        string rec;
+        rec.reserve(size);
+        rec.append((const char*)&h, sizeof(h));
+        rec.append(inv.note);
+        for (size_t i = 0; i < lines.size(); ++i) {
+            LedgerLineRecord r;
+            memset(&r, 0, sizeof(r));
+            r.unitPrice = lines.unitPrice[i];
+            r.quantity = lines.quantity[i];
+            r.taxBp = (int32_t)lines.taxBp[i];
+            r.itemId = lines.itemId[i];
+            r.descLen = (uint32_t)lines.description[i].size();
+            rec.append((const char*)&r, sizeof(r));
+            rec.append(lines.description[i]);
+        }
+        return rec;
+    }
+    uint64_t append(const Invoice& inv) { return append(inv, inv.totals()); }
+    uint64_t append(const Invoice& inv, const InvoiceTotals& t) { return append_records(encode(inv, t)); }
+    // Appends one or more encoded records with a single write per file, or
+    // queues them on the writer and returns its ticket.
+    uint64_t append_records(const string& recs) {
+        STATS_TIMER(OP_LEDGER_APPEND);
+        if (ledgerSize == 0) ledgerSize = 2 * sizeof(uint32_t);
+        vector<LedgerIndexEntry> entries;
+        for (size_t pos = 0; pos + sizeof(LedgerRecordHeader) <= recs.size();) {
+            const LedgerRecordHeader* h = (const LedgerRecordHeader*)(recs.data() + pos);
+            LedgerIndexEntry e = { h->date, h->id, h->customerId, h->recordSize, ledgerSize + pos };
+            entries.push_back(e);
+            pos += h->recordSize;
+        }
+        uint64_t ticket = 0;
+        if (writer) {
+            if (writer->size(INVOICE_LEDGER_FILE) <= 0) writer->append(INVOICE_LEDGER_FILE, file_header());
+            if (writer->size(INVOICE_LEDGER_INDEX_FILE) <= 0) writer->append(INVOICE_LEDGER_INDEX_FILE, file_header());
+            writer->append(INVOICE_LEDGER_FILE, recs);
+            ticket = writer->append(INVOICE_LEDGER_INDEX_FILE, (const char*)entries.data(), entries.size() * sizeof(LedgerIndexEntry));
+        } else {
+            {
+                bool fresh = file_stamp(INVOICE_LEDGER_FILE).size <= 0;
+                ofstream out(INVOICE_LEDGER_FILE.c_str(), ios::binary | ios::app);
+                if (fresh) write_file_header(out);
+                out.write(recs.data(), recs.size());
+            }
+            {
+                bool fresh = file_stamp(INVOICE_LEDGER_INDEX_FILE).size <= 0;
+                ofstream out(INVOICE_LEDGER_INDEX_FILE.c_str(), ios::binary | ios::app);
+                if (fresh) write_file_header(out);
+                out.write((const char*)entries.data(), entries.size() * sizeof(LedgerIndexEntry));
+            }
+            STATS_ADD(CTR_FILES_OPENED, 2);
+            STATS_ADD(CTR_BYTES_WRITTEN, recs.size() + entries.size() * sizeof(LedgerIndexEntry));
+        }
+        ledgerSize += recs.size();
+        for (auto& e : entries) {
+            if (index.empty() || !(e < index.back())) index.push_back(e);
+            else index.insert(upper_bound(index.begin(), index.end(), e), e);
+        }
+        return ticket;
+    }
+    pair<size_t, size_t> date_range(int startKey, int endKey) const {
+        LedgerIndexEntry lo = { startKey, numeric_limits<int32_t>::min(), 0, 0, 0 };
+        LedgerIndexEntry hi = { endKey, numeric_limits<int32_t>::max(), 0, 0, 0 };
+        size_t first = lower_bound(index.begin(), index.end(), lo) - index.begin();
+        size_t last = upper_bound(index.begin(), index.end(), hi) - index.begin();
+        return make_pair(first, max(first, last));
+    }
+    bool read_header(istream& in, const LedgerIndexEntry& e, LedgerRecordHeader& h) const {
+        STATS_ADD(CTR_RECORDS_SCANNED, 1);
+        STATS_ADD(CTR_BYTES_READ, sizeof(h));
+        in.seekg(e.offset);
+        return (bool)in.read((char*)&h, sizeof(h)) && h.id == e.id;
+    }
+    // Highest catalog version any invoice was priced against, 0 for an
+    // empty ledger or one written before versions were recorded.
+    uint32_t max_catalog_version() const {
+        uint32_t version = 0;
+        MappedFile mf;
+        if (!mf.open(INVOICE_LEDGER_FILE)) return version;
+        for (auto& e : index) {
+            LedgerRecordHeader h;
+            if (e.offset + sizeof(h) > mf.size) continue;
+            memcpy(&h, mf.data + e.offset, sizeof(h));
+            STATS_ADD(CTR_RECORDS_SCANNED, 1);
+            if (h.id == e.id) version = max(version, h.catalogVersion);
+        }
+        return version;
+    }
+    // Customers that have an invoice with exactly this note among the records
+    // at or after offset from.
+    unordered_set<int> customers_with_note(string_view note, uint64_t from) const {
+        unordered_set<int> out;
+        MappedFile mf;
+        if (!mf.open(INVOICE_LEDGER_FILE)) return out;
+        for (auto& e : index) {
+            LedgerRecordHeader h;
+            if (e.offset < from || e.offset + e.recordSize > mf.size || e.recordSize < sizeof(h) + note.size()) continue;
+            memcpy(&h, mf.data + e.offset, sizeof(h));
+            STATS_ADD(CTR_RECORDS_SCANNED, 1);
+            if (h.id == e.id && h.noteLen == note.size() && memcmp(mf.data + e.offset + sizeof(h), note.data(), note.size()) == 0) out.insert(h.customerId);
+        }
+        return out;
+    }
+};
+
+enum SalesGroup { GROUP_CUSTOMER, GROUP_DAY, GROUP_MONTH, GROUP_ITEM, GROUP_TAX_RATE };
+
+static const char* const SALES_GROUP_NAMES[] = { "customer", "day", "month", "item", "tax" };
+
+// Invoice-level groups (customer, day, month) add whole ledger headers.
+// Item and tax-rate groups add lines, each rounded to cents on its own, so
+// their tax can differ from the invoice-level tax by rounding.
+struct SalesAggregate {
+    int64_t count = 0;
+    int64_t quantity = 0;
+    int64_t subtotal = 0;
+    int64_t tax = 0;
+    int64_t discount = 0;
+    int64_t shipping = 0;
+    int64_t total = 0;
+    void add_invoice(const LedgerRecordHeader& h) {
+        ++count;
+        subtotal += h.subtotal;
+        tax += h.tax;
+        discount += h.discount;
+        shipping += h.shipping;
+        total += h.total;
+    }
+    void add_invoice(const InvoiceTotals& t, Money ship) {
+        ++count;
+        subtotal += t.subtotal.minor;
+        tax += t.tax.minor;
+        discount += t.discount.minor;
+        shipping += ship.minor;
+        total += t.total.minor;
+    }
+    void add_line(const LedgerLineRecord& l) {
+        int64_t exact = l.unitPrice * l.quantity;
+        ++count;
+        quantity += l.quantity;
+        subtotal += round_div(exact, QTY_SCALE);
+        tax += mul_div_round(exact, l.taxBp, QTY_SCALE * BP_SCALE);
+    }
+    void merge(const SalesAggregate& o) {
+        count += o.count;
+        quantity += o.quantity;
+        subtotal += o.subtotal;
+        tax += o.tax;
+        discount += o.discount;
+        shipping += o.shipping;
+        total += o.total;
+    }
+};
+
+typedef unordered_map<int64_t, SalesAggregate> SalesPartial;
+
+// Folds the given index entries of a mapped ledger into out. Entries that
+// fall outside the mapping (not yet written) are skipped.
+void aggregate_ledger(const char* data, size_t size, const LedgerIndexEntry* entries, size_t n, SalesGroup g, SalesPartial& out) {
+    for (size_t i = 0; i < n; ++i) {
+        const LedgerIndexEntry& e = entries[i];
+        LedgerRecordHeader h;
+        if (e.offset + e.recordSize > size || e.recordSize < sizeof(h)) continue;
+        memcpy(&h, data + e.offset, sizeof(h));
+        if (h.id != e.id) continue;
+        STATS_ADD(CTR_RECORDS_SCANNED, 1);
+        if (g == GROUP_CUSTOMER) out[h.customerId].add_invoice(h);
+        else if (g == GROUP_DAY) out[h.date].add_invoice(h);
+        else if (g == GROUP_MONTH) out[h.date / 100].add_invoice(h);
+        else {
+            const char* p = data + e.offset + sizeof(h) + h.noteLen;
+            const char* end = data + e.offset + e.recordSize;
+            for (uint32_t k = 0; k < h.lineCount && p + sizeof(LedgerLineRecord) <= end; ++k) {
+                LedgerLineRecord l;
+                memcpy(&l, p, sizeof(l));
+                out[g == GROUP_ITEM ? l.itemId : l.taxBp].add_line(l);
+                p += sizeof(l) + l.descLen;
+            }
+        }
+    }
+    STATS_ADD(CTR_BYTES_READ, n * sizeof(LedgerRecordHeader));
+}
+
+// Splits entries across hardware threads, each with its own partial map,
+// and merges the partials into key order.
+map<int64_t, SalesAggregate> parallel_aggregate(const vector<LedgerIndexEntry>& entries, size_t first, size_t last, SalesGroup g) {
+    map<int64_t, SalesAggregate> result;
+    MappedFile mf;
+    if (first >= last || !mf.open(INVOICE_LEDGER_FILE)) return result;
+    size_t n = last - first;
+    size_t workers = min<size_t>(max(1u, thread::hardware_concurrency()), (n + 8191) / 8192);
+    vector<SalesPartial> partials(workers);
+    vector<thread> pool;
+    for (size_t w = 0; w < workers; ++w) {
+        size_t lo = first + n * w / workers, hi = first + n * (w + 1) / workers;
+        pool.emplace_back([&, w, lo, hi] { aggregate_ledger(mf.data, mf.size, entries.data() + lo, hi - lo, g, partials[w]); });
+    }
+    for (auto& t : pool) t.join();
+    for (auto& part : partials) {
+        for (auto& kv : part) result[kv.first].merge(kv.second);
+    }
+    return result;
+}
+
+// Per-day invoice totals kept current on every save and persisted with the
+// ledger offset they cover, so day and month reports never scan invoices.
+// On load, records past the watermark are folded in; a missing rollup file
+// or one ahead of the ledger is rebuilt from the whole ledger.
+static const uint32_t ROLLUP_MAGIC = 0x504C5242;
+static const uint32_t ROLLUP_VERSION = 1;
+
+struct SalesRollups {
+    map<int64_t, SalesAggregate> days;
+    uint64_t watermark = 0;
+
+    void load(const InvoiceLedger& ledger) {
+        days.clear();
+        watermark = 0;
+        MappedFile mf;
+        bool valid = false;
+        if (mf.open(ROLLUP_FILE)) {
+            BinaryReader r(mf.data, mf.size);
+            if (r.get_u32() == ROLLUP_MAGIC && r.get_u32() == ROLLUP_VERSION) {
+                uint64_t mark;
+                uint32_t count = 0;
+                r.take(&mark, sizeof(mark));
+                r.take(&count, sizeof(count));
+                for (uint32_t i = 0; i < count && r.ok; ++i) {
+                    int64_t day;
+                    SalesAggregate a;
+                    r.take(&day, sizeof(day));
+                    r.take(&a, sizeof(a));
+                    days[day] = a;
+                }
+                valid = r.ok && mark <= ledger.ledgerSize;
+                watermark = mark;
+            }
+        }
+        if (!valid) {
+            days = parallel_aggregate(ledger.index, 0, ledger.index.size(), GROUP_DAY);
+        } else if (watermark < ledger.ledgerSize) {
+            vector<LedgerIndexEntry> tail;
+            for (auto& e : ledger.index) {
+                if (e.offset >= watermark) tail.push_back(e);
+            }
+            for (auto& kv : parallel_aggregate(tail, 0, tail.size(), GROUP_DAY)) days[kv.first].merge(kv.second);
+        }
+        bool stale = !valid || watermark != ledger.ledgerSize;
+        watermark = ledger.ledgerSize;
+        mf.close();
+        if (stale) save();
+    }
+    bool save() const {
+        BinaryWriter w;
+        w.put_u32(ROLLUP_MAGIC);
+        w.put_u32(ROLLUP_VERSION);
+        w.buf.append((const char*)&watermark, sizeof(watermark));
+        w.put_u32((uint32_t)days.size());
+        for (auto& kv : days) {
+            w.buf.append((const char*)&kv.first, sizeof(kv.first));
+            w.buf.append((const char*)&kv.second, sizeof(kv.second));
+        }
+        return write_file_atomic(ROLLUP_FILE, w.buf);
+    }
+    map<int64_t, SalesAggregate> range(int startKey, int endKey, SalesGroup g) const {
+        map<int64_t, SalesAggregate> out;
+        for (auto d = days.lower_bound(startKey); d != days.end() && d->first <= endKey; ++d) {
+            out[g == GROUP_MONTH ? d->first / 100 : d->first].merge(d->second);
+        }
+        return out;
+    }
+};
+
+// Running per-customer totals, updated by every save and persisted with the
+// ledger offset they cover (same scheme as SalesRollups). The
+// customer -> invoice index holds ledger offsets and is rebuilt from the
+// ledger index on load, so a statement reads only that customer's records.
+static const uint32_t ACCOUNTS_MAGIC = 0x43434142;
+static const uint32_t ACCOUNTS_VERSION = 1;
+
+struct CustomerAccount {
+    int64_t lifetimeTotal = 0;
+    int32_t invoiceCount = 0;
+    int32_t lastInvoiceDate = 0;
+    vector<pair<int32_t, int64_t>> months;
+    void add(int32_t date, int64_t total) {
+        lifetimeTotal += total;
+        ++invoiceCount;
+        lastInvoiceDate = max(lastInvoiceDate, date);
+        int32_t month = date / 100;
+        if (months.empty() || months.back().first < month) months.push_back(make_pair(month, total));
+        else {
+            auto m = lower_bound(months.begin(), months.end(), make_pair(month, numeric_limits<int64_t>::min()));
+            if (m != months.end() && m->first == month) m->second += total;
+            else months.insert(m, make_pair(month, total));
+        }
+    }
+};
+
+struct CustomerAccounts {
+    unordered_map<int, CustomerAccount> accounts;
+    unordered_map<int, vector<uint64_t>> invoiceOffsets;
+    uint64_t watermark = 0;
+
+    void add(int customerId, int32_t date, int64_t total, uint64_t offset) {
+        accounts[customerId].add(date, total);
+        invoiceOffsets[customerId].push_back(offset);
+    }
+    void fold(const InvoiceLedger& ledger, uint64_t from) {
+        MappedFile mf;
+        if (!mf.open(INVOICE_LEDGER_FILE)) return;
+        vector<const LedgerIndexEntry*> tail;
+        for (auto& e : ledger.index) {
+            if (e.offset >= from) tail.push_back(&e);
+        }
+        sort(tail.begin(), tail.end(), [](const LedgerIndexEntry* a, const LedgerIndexEntry* b) { return a->offset < b->offset; });
+        LedgerRecordHeader h;
+        for (const LedgerIndexEntry* e : tail) {
+            if (e->offset + sizeof(h) > mf.size) continue;
+            memcpy(&h, mf.data + e->offset, sizeof(h));
+            if (h.id != e->id) continue;
+            STATS_ADD(CTR_RECORDS_SCANNED, 1);
+            accounts[h.customerId].add(h.date, h.total);
+        }
+    }
+    void load(const InvoiceLedger& ledger) {
+        accounts.clear();
+        invoiceOffsets.clear();
+        watermark = 0;
+        bool valid = false;
+        {
+            MappedFile mf;
+            if (mf.open(ACCOUNTS_FILE)) {
+                BinaryReader r(mf.data, mf.size);
+                if (r.get_u32() == ACCOUNTS_MAGIC && r.get_u32() == ACCOUNTS_VERSION) {
+                    uint64_t mark = (uint64_t)r.get_i64();
+                    uint32_t count = r.get_u32();
+                    for (uint32_t i = 0; i < count && r.ok; ++i) {
+                        CustomerAccount& a = accounts[r.get_i32()];
+                        a.invoiceCount = r.get_i32();
+                        a.lastInvoiceDate = r.get_i32();
+                        a.lifetimeTotal = r.get_i64();
+                        uint32_t months = r.get_u32();
+                        if (months > (size_t)(r.end - r.p) / 12) { r.ok = false; break; }
+                        a.months.resize(months);
+                        for (auto& m : a.months) {
+                            m.first = r.get_i32();
+                            m.second = r.get_i64();
+                        }
+                    }
+                    valid = r.ok && mark <= ledger.ledgerSize;
+                    watermark = mark;
+                }
+            }
+        }
+        if (!valid) {
+            accounts.clear();
+            watermark = 0;
+        }
+        if (watermark < ledger.ledgerSize) fold(ledger, watermark);
+        // The index is in (date, id) order, but pages walk a customer's
+        // records by offset, which differs once a record is saved with an
+        // earlier date than one before it.
+        for (auto& e : ledger.index) invoiceOffsets[e.customerId].push_back(e.offset);
+        for (auto& kv : invoiceOffsets) {
+            if (!is_sorted(kv.second.begin(), kv.second.end())) sort(kv.second.begin(), kv.second.end());
+        }
+        bool stale = watermark != ledger.ledgerSize;
+        watermark = ledger.ledgerSize;
+        if (stale) save();
+    }
+    bool save() const {
+        BinaryWriter w;
+        w.put_u32(ACCOUNTS_MAGIC);
+        w.put_u32(ACCOUNTS_VERSION);
+        w.put_i64((int64_t)watermark);
+        w.put_u32((uint32_t)accounts.size());
+        for (auto& kv : accounts) {
+            const CustomerAccount& a = kv.second;
+            w.put_i32(kv.first);
+            w.put_i32(a.invoiceCount);
+            w.put_i32(a.lastInvoiceDate);
+            w.put_i64(a.lifetimeTotal);
+            w.put_u32((uint32_t)a.months.size());
+            for (auto& m : a.months) {
+                w.put_i32(m.first);
+                w.put_i64(m.second);
+            }
+        }
+        return write_file_atomic(ACCOUNTS_FILE, w.buf);
+    }
+    const CustomerAccount* find(int customerId) const {
+        auto f = accounts.find(customerId);
+        return f == accounts.end() ? nullptr : &f->second;
+    }
+};
+
+// Byte-oriented LZ77 in the LZ4 block layout: a token holds the literal
+// run (high nibble) and match length minus 4 (low nibble), 15 spills into
+// 255-continued bytes, and matches carry a 16-bit back offset. The last
+// sequence is literals only.
+static void lz_put_length(string& out, size_t n) {
+    for (; n >= 255; n -= 255) out += (char)255;
+    out += (char)n;
+}
+
+void lz_compress(const char* src, size_t n, string& out) {
+    const int HASH_BITS = 12;
+    int32_t table[1 << HASH_BITS];
+    fill(table, table + (1 << HASH_BITS), -1);
+    size_t anchor = 0, i = 0;
+    auto emit = [&](size_t litEnd, size_t offset, size_t match) {
+        size_t lit = litEnd - anchor;
+        size_t ml = match ? match - 4 : 0;
+        out += (char)((min<size_t>(lit, 15) << 4) | min<size_t>(ml, 15));
+        if (lit >= 15) lz_put_length(out, lit - 15);
+        out.append(src + anchor, lit);
+        if (!match) return;
+        out += (char)(offset & 0xFF);
+        out += (char)(offset >> 8);
+        if (ml >= 15) lz_put_length(out, ml - 15);
+    };
+    while (i + 4 <= n) {
+        uint32_t v;
+        memcpy(&v, src + i, 4);
+        uint32_t h = (v * 2654435761u) >> (32 - HASH_BITS);
+        int32_t cand = table[h];
+        table[h] = (int32_t)i;
+        if (cand >= 0 && i - cand <= 0xFFFF && memcmp(src + cand, src + i, 4) == 0) {
+            size_t len = 4;
+            while (i + len < n && src[cand + len] == src[i + len]) ++len;
+            emit(i, i - cand, len);
+            i += len;
+            anchor = i;
+        } else {
+            ++i;
+        }
+    }
+    emit(n, 0, 0);
+}
+
+bool lz_decompress(const char* p, size_t n, size_t rawLen, string& out) {
+    const unsigned char* in = (const unsigned char*)p;
+    const unsigned char* end = in + n;
+    out.clear();
+    out.reserve(rawLen);
+    auto length = [&](size_t base, size_t& v) {
+        v = base;
+        if (base != 15) return true;
+        unsigned char b;
+        do {
+            if (in >= end) return false;
+            b = *in++;
+            v += b;
+        } while (b == 255);
+        return true;
+    };
+    while (in < end) {
+        unsigned token = *in++;
+        size_t lit, ml;
+        if (!length(token >> 4, lit) || (size_t)(end - in) < lit || out.size() + lit > rawLen) return false;
+        out.append((const char*)in, lit);
+        in += lit;
+        if (in == end) break;
+        if (end - in < 2) return false;
+        size_t offset = in[0] | (in[1] << 8);
+        in += 2;
+        if (!length(token & 15, ml)) return false;
+        ml += 4;
+        if (offset == 0 || offset > out.size() || out.size() + ml > rawLen) return false;
+        size_t from = out.size() - offset;
+        for (size_t k = 0; k < ml; ++k) out += out[from + k];
+    }
+    return out.size() == rawLen;
+}
+
+// Invoice documents live in append-only segment files under invoices/,
+// each record a header plus the (optionally LZ-compressed) text. The index
+// file maps invoice id to segment and offset; a missing or short index is
+// rebuilt from the segment tail on load, like the ledger index.
+static const uint32_t DOCUMENT_MAGIC = 0x434F4442;
+static const uint32_t DOCUMENT_COMPRESSED = 1;
+
+struct DocumentRecordHeader {
+    uint32_t magic;
+    int32_t id;
+    uint32_t storedLen;
+    uint32_t rawLen;
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+struct DocumentIndexEntry {
+    int32_t id;
+    uint32_t segment;
+    uint64_t offset;
+    uint32_t length;
+    uint32_t reserved;
+};
+
+struct DocumentStore {
+    unordered_map<int, DocumentIndexEntry> index;
+    uint32_t segment = 1;
+    uint64_t segmentSize = 0;
+    bool compress = false;
+    string pendingData;
+    string pendingIndex;
+    GroupCommitWriter* writer = nullptr;
+    uint64_t lastTicket = 0;
+#ifndef _WIN32
+    vector<int> fds;
+    mutex fdLock;
+#endif
+
+    DocumentStore() {}
+    DocumentStore(const DocumentStore&) = delete;
+    DocumentStore& operator=(const DocumentStore&) = delete;
+    ~DocumentStore() { close_segments(); }
+
+    static string segment_path(uint32_t n) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "/segment_%06u.dat", n);
+        return INVOICES_FOLDER + buf;
+    }
+    static void remove_files() {
+        for (uint32_t n = 1; remove(segment_path(n).c_str()) == 0; ++n) {}
+        remove(DOCUMENT_INDEX_FILE.c_str());
+    }
+    void close_segments() {
+#ifndef _WIN32
+        for (int fd : fds) if (fd >= 0) ::close(fd);
+        fds.clear();
+#endif
+    }
+    // Indexes records in segment n from offset onward; returns the end of
+    // the last complete record.
+    uint64_t scan_segment(uint32_t n, uint64_t offset, string& newIndex) {
+        MappedFile mf;
+        if (!mf.open(segment_path(n))) return offset;
+        DocumentRecordHeader h;
+        while (offset + sizeof(h) <= mf.size) {
+            memcpy(&h, mf.data + offset, sizeof(h));
+            if (h.magic != DOCUMENT_MAGIC || offset + sizeof(h) + h.storedLen > mf.size) break;
+            DocumentIndexEntry e = { h.id, n, offset, (uint32_t)(sizeof(h) + h.storedLen), 0 };
+            index[e.id] = e;
+            newIndex.append((const char*)&e, sizeof(e));
+            STATS_ADD(CTR_RECORDS_SCANNED, 1);
+            offset += e.length;
+        }
+        return offset;
+    }
+    void load() {
+        close_segments();
+        index.clear();
+        segment = 1;
+        segmentSize = 0;
+        MappedFile mf;
+        if (mf.open(DOCUMENT_INDEX_FILE)) {
+            size_t count = mf.size / sizeof(DocumentIndexEntry);
+            index.reserve(count);
+            for (size_t i = 0; i < count; ++i) {
+                DocumentIndexEntry e;
+                memcpy(&e, mf.data + i * sizeof(e), sizeof(e));
+                index[e.id] = e;
+                if (e.segment > segment || (e.segment == segment && e.offset + e.length > segmentSize)) {
+                    segment = e.segment;
+                    segmentSize = e.offset + e.length;
+                }
+            }
+            if (mf.size % sizeof(DocumentIndexEntry)) {
+                string whole(mf.data, count * sizeof(DocumentIndexEntry));
+                mf.close();
+                write_file_atomic(DOCUMENT_INDEX_FILE, whole);
+            }
+        }
+        // The index and segment are synced independently, so after a crash
+        // the index may point past the data it describes.
+        unordered_map<uint32_t, int64_t> sizes;
+        for (auto e = index.begin(); e != index.end();) {
+            auto sz = sizes.find(e->second.segment);
+            if (sz == sizes.end()) sz = sizes.emplace(e->second.segment, file_stamp(segment_path(e->second.segment)).size).first;
+            if ((int64_t)(e->second.offset + e->second.length) > sz->second) e = index.erase(e);
+            else ++e;
+        }
+        if (segmentSize > 0 && (int64_t)segmentSize > file_stamp(segment_path(segment)).size) {
+            segmentSize = 0;
+            for (auto& e : index) {
+                if (e.second.segment == segment) segmentSize = max(segmentSize, e.second.offset + e.second.length);
+            }
+        }
+        string tail;
+        for (;;) {
+            int64_t size = file_stamp(segment_path(segment)).size;
+            if (size > (int64_t)segmentSize) segmentSize = scan_segment(segment, segmentSize, tail);
+            // Never append after a torn record: move on to a fresh segment.
+            if (size > (int64_t)segmentSize) { ++segment; segmentSize = 0; continue; }
+            if (file_stamp(segment_path(segment + 1)).size <= 0) break;
+            ++segment;
+            segmentSize = 0;
+        }
+        if (!tail.empty()) {
+            ofstream out(DOCUMENT_INDEX_FILE.c_str(), ios::binary | ios::app);
+            out.write(tail.data(), tail.size());
+        }
+    }
+    bool contains(int id) const { return index.count(id) != 0; }
+    // Queues a document; call flush() to write the queued batch.
+    void append(int id, const char* doc, size_t n) {
+        DocumentRecordHeader h = { DOCUMENT_MAGIC, id, (uint32_t)n, (uint32_t)n, 0, 0 };
+        string packed;
+        if (compress) {
+            lz_compress(doc, n, packed);
+            if (packed.size() < n) {
+                h.storedLen = (uint32_t)packed.size();
+                h.flags = DOCUMENT_COMPRESSED;
+            }
+        }
+        uint64_t length = sizeof(h) + h.storedLen;
+        if (segmentSize > 0 && segmentSize + pendingData.size() + length > DOCUMENT_SEGMENT_MAX) {
+            flush(false);
+            ++segment;
+            segmentSize = 0;
+        }
+        DocumentIndexEntry e = { id, segment, segmentSize + pendingData.size(), (uint32_t)length, 0 };
+        pendingData.append((const char*)&h, sizeof(h));
+        if (h.flags & DOCUMENT_COMPRESSED) pendingData += packed;
+        else pendingData.append(doc, n);
+        pendingIndex.append((const char*)&e, sizeof(e));
+        index[id] = e;
+    }
+    bool flush(bool sync) {
+        if (pendingData.empty()) return true;
+        if (writer) {
+            writer->append(segment_path(segment), pendingData);
+            lastTicket = writer->append(DOCUMENT_INDEX_FILE, pendingIndex);
+            segmentSize += pendingData.size();
+            pendingData.clear();
+            pendingIndex.clear();
+            return true;
+        }
+        STATS_ADD(CTR_FILES_OPENED, 2);
+        STATS_ADD(CTR_BYTES_WRITTEN, pendingData.size() + pendingIndex.size());
+        bool ok;
+        {
+            ofstream out(segment_path(segment).c_str(), ios::binary | ios::app);
+            out.write(pendingData.data(), pendingData.size());
+            out.flush();
+            ok = (bool)out;
+        }
+#ifndef _WIN32
+        if (ok && sync) {
+            int fd = ::open(segment_path(segment).c_str(), O_WRONLY);
+            ok = fd >= 0 && fsync(fd) == 0;
+            if (fd >= 0) ::close(fd);
+        }
+#else
+        (void)sync;
+#endif
+        {
+            ofstream out(DOCUMENT_INDEX_FILE.c_str(), ios::binary | ios::app);
+            out.write(pendingIndex.data(), pendingIndex.size());
+        }
+        segmentSize += pendingData.size();
+        pendingData.clear();
+        pendingIndex.clear();
+        return ok;
+    }
+    uint64_t put(int id, const string& doc) {
+        append(id, doc.data(), doc.size());
+        flush(false);
+        return lastTicket;
+    }
+    bool read_at(uint32_t seg, uint64_t offset, char* buf, size_t n) {
+        if (writer && !writer->written(segment_path(seg), (int64_t)(offset + n))) return false;
+        STATS_ADD(CTR_BYTES_READ, n);
+#ifdef _WIN32
+        STATS_ADD(CTR_FILES_OPENED, 1);
+        ifstream in(segment_path(seg).c_str(), ios::binary);
+        in.seekg(offset);
+        return (bool)in.read(buf, n);
+#else
+        int fd;
+        {
+            lock_guard<mutex> g(fdLock);
+            if (fds.size() <= seg) fds.resize(seg + 1, -1);
+            if (fds[seg] < 0) {
+                fds[seg] = ::open(segment_path(seg).c_str(), O_RDONLY);
+                if (fds[seg] < 0) return false;
+                STATS_ADD(CTR_FILES_OPENED, 1);
+            }
+            fd = fds[seg];
+        }
+        size_t done = 0;
+        while (done < n) {
+            ssize_t r = pread(fd, buf + done, n - done, (off_t)(offset + done));
+            if (r <= 0) return false;
+            done += (size_t)r;
+        }
+        return true;
+#endif
+    }
+    bool get(int id, string& out) {
+        STATS_TIMER(OP_READ_DOCUMENT);
+        auto f = index.find(id);
+        if (f == index.end()) return false;
+        const DocumentIndexEntry& e = f->second;
+        DocumentRecordHeader h;
+        if (e.length < sizeof(h)) return false;
+        string rec(e.length, '\0');
+        if (!read_at(e.segment, e.offset, &rec[0], e.length)) return false;
+        memcpy(&h, rec.data(), sizeof(h));
+        if (h.magic != DOCUMENT_MAGIC || h.id != id || sizeof(h) + h.storedLen != e.length) return false;
+        if (h.flags & DOCUMENT_COMPRESSED) return lz_decompress(rec.data() + sizeof(h), h.storedLen, h.rawLen, out);
+        out.assign(rec, sizeof(h), h.storedLen);
+        return true;
+    }
+};
+
+// id_counters.bin holds the first unleased id of each kind. A process leases
+// a block of ids by raising that mark under an exclusive lock on the file and
+// syncing it before any id in the block is used, so concurrent processes
+// never share an id and a crash at any point only leaves a gap. Threads take
+// ids from their process's current block with a compare-and-swap. The file
+// has two slots written in turn, each with its sequence number at both ends,
+// so a torn write leaves the previous slot readable.
+// Catalog versions are allocated the same way, so a version number names
+// one catalog even across restarts and processes.
+enum IdKind { ID_CUSTOMER, ID_ITEM, ID_INVOICE, ID_CATALOG, ID_KIND_COUNT };
+static const int32_t ID_FIRST[ID_KIND_COUNT] = { 1001, 5001, 9001, 1 };
+static const uint32_t ID_COUNTERS_MAGIC = 0x44494E43;
+static const int32_t ID_LEASE_SIZE = 64;
+
+struct IdAllocator {
+    struct Slot {
+        uint32_t magic;
+        uint32_t seq;
+        int32_t next[ID_KIND_COUNT];
+        uint32_t seqEnd;
+    };
+    int fd = -1;
+    uint32_t seq = 0;
+    int32_t marks[ID_KIND_COUNT] = { ID_FIRST[0], ID_FIRST[1], ID_FIRST[2], ID_FIRST[3] };
+    bool stored = false;
+    mutex leaseLock;
+    // Current block: its end in the high word and the next id in the low one.
+    atomic<uint64_t> blocks[ID_KIND_COUNT];
+
+    IdAllocator() {
+        for (auto& b : blocks) b.store(0);
+    }
+    ~IdAllocator() { close_file(); }
+    // Without the file, ids would not be persisted and a later run could
+    // reissue them, so callers refuse to start.
+    bool open(const string& path) {
+        close_file();
+#ifdef _WIN32
+        fd = _open(path.c_str(), _O_RDWR | _O_CREAT | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+#endif
+        if (fd < 0) cerr << "Cannot open " << path << ": " << strerror(errno) << "\n";
+        return fd >= 0;
+    }
+    void close_file() {
+        if (fd < 0) return;
+#ifdef _WIN32
+        _close(fd);
+#else
+        ::close(fd);
+#endif
+        fd = -1;
+    }
+    // Returns 0, which no kind uses as an id, when a new block could not be
+    // persisted.
+    int allocate(IdKind kind, int n = 1) {
+        atomic<uint64_t>& b = blocks[kind];
+        uint64_t s = b.load();
+        while (true) {
+            if ((uint32_t)(s >> 32) - (uint32_t)s < (uint32_t)n) {
+                if (!lease(kind, n)) return 0;
+                s = b.load();
+            } else if (b.compare_exchange_weak(s, s + (uint32_t)n)) {
+                return (int)(uint32_t)s;
+            }
+        }
+    }
+    // Whether the counters file held marks before this process wrote any.
+    bool has_stored_marks() {
+        lock_guard<mutex> g(leaseLock);
+        lock_file();
+        read_marks();
+        unlock_file();
+        return stored;
+    }
+    // Raises the marks to at least floors, for a counters file that is new
+    // or older than the data.
+    bool raise(const int32_t* floors) {
+        lock_guard<mutex> g(leaseLock);
+        lock_file();
+        read_marks();
+        bool changed = false;
+        for (int k = 0; k < ID_KIND_COUNT; ++k) {
+            if (floors[k] > marks[k]) { marks[k] = floors[k]; changed = true; }
+        }
+        bool ok = !changed || write_marks();
+        unlock_file();
+        return ok;
+    }
+    // Hands back the unused rest of each block that is still the latest
+    // lease, so a process that exits cleanly leaves no gap.
+    void release() {
+        lock_guard<mutex> g(leaseLock);
+        lock_file();
+        read_marks();
+        bool changed = false;
+        for (int k = 0; k < ID_KIND_COUNT; ++k) {
+            uint64_t s = blocks[k].exchange(0);
+            if (s == 0 || marks[k] != (int32_t)(s >> 32)) continue;
+            marks[k] = (int32_t)(uint32_t)s;
+            changed = true;
+        }
+        if (changed) write_marks();
+        unlock_file();
+    }
+    // The block is only handed out once its mark is on disk.
+    bool lease(IdKind kind, int n) {
+        lock_guard<mutex> g(leaseLock);
+        uint64_t s = blocks[kind].load();
+        if ((uint32_t)(s >> 32) - (uint32_t)s >= (uint32_t)n) return true;
+        lock_file();
+        read_marks();
+        uint32_t start = (uint32_t)marks[kind];
+        marks[kind] += max(n, ID_LEASE_SIZE);
+        bool ok = write_marks();
+        if (!ok) marks[kind] = (int32_t)start;
+        unlock_file();
+        if (!ok) return false;
+        // When no other process leased in between, the new block continues
+        // the current one and ids stay consecutive.
+        uint64_t end = (uint64_t)(uint32_t)marks[kind] << 32;
+        while (!blocks[kind].compare_exchange_weak(s, end | ((uint32_t)(s >> 32) == start ? (uint32_t)s : start))) {}
+        return true;
+    }
+    void lock_file() {
+        if (fd < 0) return;
+#ifdef _WIN32
+        _lseeki64(fd, 0, SEEK_SET);
+        while (_locking(fd, _LK_LOCK, 1) != 0) {}
+#else
+        while (flock(fd, LOCK_EX) != 0 && errno == EINTR) {}
+#endif
+    }
+    void unlock_file() {
+        if (fd < 0) return;
+#ifdef _WIN32
+        _lseeki64(fd, 0, SEEK_SET);
+        _locking(fd, _LK_UNLCK, 1);
+#else
+        flock(fd, LOCK_UN);
+#endif
+    }
+    // Keeps the cached marks when the file has no valid slot yet.
+    void read_marks() {
+        if (fd < 0) return;
+        Slot slots[2];
+        memset(slots, 0, sizeof(slots));
+        STATS_ADD(CTR_BYTES_READ, sizeof(slots));
+#ifdef _WIN32
+        _lseeki64(fd, 0, SEEK_SET);
+        if (_read(fd, slots, sizeof(slots)) < 0) return;
+#else
+        if (pread(fd, slots, sizeof(slots), 0) < 0) return;
+#endif
+        const Slot* best = nullptr;
+        for (const Slot& sl : slots) {
+            if (sl.magic == ID_COUNTERS_MAGIC && sl.seq == sl.seqEnd && (!best || sl.seq > best->seq)) best = &sl;
+        }
+        if (!best) return;
+        stored = true;
+        seq = best->seq;
+        for (int k = 0; k < ID_KIND_COUNT; ++k) marks[k] = max(marks[k], best->next[k]);
+    }
+    // A failed write leaves seq where it was, so the next attempt reuses the
+    // torn slot and the other one keeps the last good marks.
+    bool write_marks() {
+        if (fd < 0) return false;
+        Slot sl;
+        sl.magic = ID_COUNTERS_MAGIC;
+        sl.seq = sl.seqEnd = ++seq;
+        memcpy(sl.next, marks, sizeof(marks));
+        int64_t offset = (int64_t)(seq & 1) * (int64_t)sizeof(Slot);
+        STATS_ADD(CTR_BYTES_WRITTEN, sizeof(sl));
+        STATS_ADD(CTR_FSYNCS, 1);
+#ifdef _WIN32
+        bool ok = _lseeki64(fd, offset, SEEK_SET) == offset && _write(fd, &sl, sizeof(sl)) == (int)sizeof(sl) && _commit(fd) == 0;
+#else
+        bool ok = pwrite(fd, &sl, sizeof(sl), (off_t)offset) == (ssize_t)sizeof(sl) && fsync(fd) == 0;
+#endif
+        if (!ok) {
+            cerr << "Warning: could not persist id counters: " << strerror(errno) << "\n";
+            --seq;
+        }
+        return ok;
+    }
+};
+
+// Keyset position in a sorted listing: the sort key and id of the last row
+// returned, so the next page starts with a binary search instead of
+// skipping rows. Listings fill only the key parts they sort on.
+struct ListCursor {
+    string text;
+    int64_t number = 0;
+    int id = 0;
+    bool started = false;
+    bool more = true;
+};
+
+struct BillingSystem {
+    GroupCommitWriter writer;
+    CustomerTable customers;
+    CatalogPublisher catalog;
+    unordered_map<int, size_t> customerById;
+    // Customer positions ordered by (name, id). Built on first use, since
+    // sorting a large table would slow every startup, and kept current by
+    // insert and remove from then on.
+    vector<uint32_t> customersByName;
+    atomic<bool> customersByNameReady{ false };
+    mutex customersByNameLock;
+    SearchIndex customerSearch;
+    SearchIndex itemSearch;
+    InvoiceLedger ledger;
+    InvoiceRenderer renderer;
+    DocumentStore documents;
+    SalesRollups rollups;
+    CustomerAccounts accounts;
+    TaxEngine taxes;
+    IdAllocator ids;
+    BillingSystem() {
+        ledger.writer = &writer;
+        documents.writer = &writer;
+        ensure_invoices_folder();
+        vector<Invoice> legacyInvoices;
+        bool legacy = !file_exists(INVOICE_LEDGER_FILE) && file_stamp(INVOICES_META_FILE).size > 0;
+        ledger.load();
+        documents.load();
+        taxes.load(TAX_RULES_FILE);
+        catalog.taxes = &taxes;
+        if (!ids.open(ID_COUNTERS_FILE)) exit_without_ids();
+        load_all(legacy ? &legacyInvoices : nullptr);
+        if (!legacyInvoices.empty()) {
+            migrate_invoices_to_ledger(legacyInvoices);
+            writer.sync();
+        }
+        rollups.load(ledger);
+        accounts.load(ledger);
+    }
+    void ensure_invoices_folder() {
+        make_directory(INVOICES_FOLDER);
+    }
+    // onRow returns false for a row it cannot use; those are counted and
+    // reported rather than dropped silently.
+    template <class F>
+    void load_csv(const string& path, int32_t& nextId, F onRow) {
+        MappedFile mf;
+        if (!mf.open(path)) return;
+        CsvParser ps(mf.data, mf.data + mf.size);
+        size_t rejected = 0, firstLine = 0;
+        while (ps.next()) {
+            STATS_ADD(CTR_RECORDS_SCANNED, 1);
+            int id;
+            if (!ps.error && !ps.fields.empty()) {
+                if (parse_int(ps.fields[0], id) && id >= nextId) nextId = id + 1;
+                if (onRow(ps.fields.data(), ps.fields.size())) continue;
+            }
+            if (rejected++ == 0) firstLine = ps.recordLine;
+        }
+        if (rejected) cout << "Warning: skipped " << rejected << " malformed row(s) in " << path << " (first at line " << firstLine << ").\n";
+    }
+    // The meta file is only read, into invoiceMeta, when a tree without a
+    // ledger needs migrating; invoice details come from the ledger. Ids are
+    // not derived from the data, but the id counters are raised past every
+    // id loaded in case the counters file is missing or older than the data.
+    // The loaded catalog is published under a newly allocated version.
+    void load_all(vector<Invoice>* invoiceMeta = nullptr) {
+        STATS_TIMER(OP_LOAD_ALL);
+        unique_ptr<CatalogSnapshot> next(new CatalogSnapshot());
+        ItemTable& items = next->items;
+        int32_t floors[ID_KIND_COUNT] = { ID_FIRST[0], ID_FIRST[1], ID_FIRST[2], ID_FIRST[3] };
+        customers.clear();
+        if (invoiceMeta || !load_snapshot(items)) {
+            load_csv(CUSTOMERS_FILE, floors[ID_CUSTOMER], [&](const string_view* f, size_t n) {
+                Customer c;
+                if (!Customer::from_fields(f, n, c)) return false;
+                customers.push_back(c);
+                return true;
+            });
+            load_csv(ITEMS_FILE, floors[ID_ITEM], [&](const string_view* f, size_t n) {
+                Item it;
+                if (!Item::from_fields(f, n, it)) return false;
+                items.push_back(it);
+                return true;
+            });
+            if (invoiceMeta) load_csv(INVOICES_META_FILE, floors[ID_INVOICE], [&](const string_view* f, size_t n) {
+                Invoice inv;
+                int64_t discountBp;
+                if (n < 5 || !parse_int(f[0], inv.id) || !parse_int(f[1], inv.customerId)) return false;
+                if (!parse_decimal(f[3], 100, discountBp) || !Money::parse(f[4], inv.shipping)) return false;
+                inv.discountBp = (int32_t)discountBp;
+                inv.date.assign(f[2]);
+                int version;
+                if (n > 5 && parse_int(f[5], version)) inv.catalogVersion = (uint32_t)version;
+                invoiceMeta->push_back(inv);
+                return true;
+            });
+            replay_change_log(items, floors);
+        }
+        for (auto c : customers) floors[ID_CUSTOMER] = max(floors[ID_CUSTOMER], c.id + 1);
+        for (auto it : items) floors[ID_ITEM] = max(floors[ID_ITEM], it.id + 1);
+        for (auto& e : ledger.index) floors[ID_INVOICE] = max(floors[ID_INVOICE], e.id + 1);
+        if (!ids.has_stored_marks()) floors[ID_CATALOG] = (int32_t)ledger.max_catalog_version() + 1;
+        if (!ids.raise(floors)) exit_without_ids();
+        reindex_customers(0);
+        drop_customer_name_index();
+        next->index();
+        for (size_t k = 1, head = 0; k < next->byCode.size(); ++k) {
+            uint32_t i = next->byCode[k], first = next->byCode[head];
+            if (items.code[i].view() != items.code[first].view()) { head = k; continue; }
+            cout << "Warning: duplicate SKU '" << items.code[i].view() << "' (item " << items.id[i] << "); lookups use item " << items.id[first] << ".\n";
+        }
+        customerSearch.clear();
+        for (auto c : customers) customerSearch.add(c.id, search_text(c.name, c.email));
+        customerSearch.shrink();
+        itemSearch.clear();
+        for (auto it : items) itemSearch.add(it.id, search_text(it.code, it.description));
+        itemSearch.shrink();
+        next->version = (uint32_t)ids.allocate(ID_CATALOG);
+        if (!next->version) exit_without_ids();
+        catalog.publish(next.release());
+    }
+    // Running on would hand out ids a later run could hand out again.
+    [[noreturn]] static void exit_without_ids() {
+        cerr << "Cannot persist id counters in " << ID_COUNTERS_FILE << "; not starting.\n";
+        exit(1);
+    }
+    static string search_text(string_view a, string_view b) {
+        string s;
+        s.reserve(a.size() + b.size() + 1);
+        s.append(a.data(), a.size());
+        s += ' ';
+        s.append(b.data(), b.size());
+        return s;
+    }
+    vector<FileStamp> source_stamps() const {
+        vector<FileStamp> v;
+        v.push_back(file_stamp(CUSTOMERS_FILE));
+        v.push_back(file_stamp(ITEMS_FILE));
+        v.push_back(file_stamp(INVOICES_META_FILE));
+        v.push_back(file_stamp(CHANGE_LOG_FILE));
+        return v;
+    }
+    // The snapshot is a binary image of the CSV-derived state written at clean
+    // shutdown. It is used only if every source file still has the stamp
+    // recorded in it, and it is removed once loaded so that a session
+    // that does not exit cleanly falls back to the CSVs.
+    bool load_snapshot(ItemTable& items) {
+        STATS_TIMER(OP_SNAPSHOT_LOAD);
+        MappedFile mf;
+        if (!mf.open(SNAPSHOT_FILE)) return false;
+        BinaryReader r(mf.data, mf.size);
+        bool valid = r.get_u32() == SNAPSHOT_MAGIC && r.get_u32() == SNAPSHOT_VERSION;
+        vector<FileStamp> stamps = source_stamps();
+        for (auto& st : stamps) {
+            FileStamp saved;
+            saved.size = r.get_i64();
+            saved.mtime = r.get_i64();
+            saved.ctime = r.get_i64();
+            saved.inode = r.get_i64();
+            if (!(saved == st)) valid = false;
+        }
+        if (valid) {
+            uint32_t n = r.get_u32();
+            customers.reserve(min<size_t>(n, mf.size / 24));
+            CustomerRow c;
+            for (uint32_t i = 0; i < n && r.ok; ++i) {
+                c.id = r.get_i32();
+                c.name = r.get_view();
+                c.address = r.get_view();
+                c.email = r.get_view();
+                c.phone = r.get_view();
+                customers.push_back(c);
+            }
+            n = r.get_u32();
+            items.reserve(min<size_t>(n, mf.size / 24));
+            ItemRow it;
+            for (uint32_t i = 0; i < n && r.ok; ++i) {
+                it.id = r.get_i32();
+                it.code = r.get_view();
+                it.description = r.get_view();
+                it.unitPrice = Money::cents(r.get_i64());
+                it.taxBp = r.get_i32();
+                items.push_back(it);
+            }
+            valid = r.ok;
+        }
+        mf.close();
+        remove(SNAPSHOT_FILE.c_str());
+        if (!valid) {
+            customers.clear();
+            items.clear();
+        }
+        return valid;
+    }
+    void save_snapshot() {
+        STATS_TIMER(OP_SNAPSHOT_SAVE);
+        BinaryWriter w;
+        w.put_u32(SNAPSHOT_MAGIC);
+        w.put_u32(SNAPSHOT_VERSION);
+        for (auto& st : source_stamps()) {
+            w.put_i64(st.size);
+            w.put_i64(st.mtime);
+            w.put_i64(st.ctime);
+            w.put_i64(st.inode);
+        }
+        w.put_u32((uint32_t)customers.size());
+        const ItemTable& items = catalog.latest().items;
+        for (auto c : customers) {
+            w.put_i32(c.id);
+            w.put_str(c.name);
+            w.put_str(c.address);
+            w.put_str(c.email);
+            w.put_str(c.phone);
+        }
+        w.put_u32((uint32_t)items.size());
+        for (auto it : items) {
+            w.put_i32(it.id);
+            w.put_str(it.code);
+            w.put_str(it.description);
+            w.put_i64(it.unitPrice.minor);
+            w.put_i32(it.taxBp);
+        }
+        write_file_atomic(SNAPSHOT_FILE, w.buf);
+    }
+    // changes.log holds customer and item mutations since the last compaction,
+    // one per line: "C+,<customer csv>", "C-,<id>", "I+,<item csv>", "I-,<id>".
+    // Later entries win; tombstoned ids still count towards the id floors.
+    template <class Table, class T>
+    static void apply_changes(Table& rows, unordered_map<int, pair<bool, T>>& ops, const vector<int>& order) {
+        if (ops.empty()) return;
+        size_t kept = 0;
+        for (size_t i = 0; i < rows.size(); ++i) {
+            auto op = ops.find(rows.id[i]);
+            if (op != ops.end()) {
+                bool keep = op->second.first;
+                if (keep) rows.set(i, op->second.second.row());
+                ops.erase(op);
+                if (!keep) continue;
+            }
+            if (kept != i) rows.move_row(kept, i);
+            ++kept;
+        }
+        rows.resize(kept);
+        for (int id : order) {
+            auto op = ops.find(id);
+            if (op == ops.end()) continue;
+            if (op->second.first) rows.push_back(op->second.second);
+            ops.erase(op);
+        }
+    }
+    void replay_change_log(ItemTable& items, int32_t* floors) {
+        MappedFile mf;
+        if (!mf.open(CHANGE_LOG_FILE)) return;
+        unordered_map<int, pair<bool, Customer>> customerOps;
+        unordered_map<int, pair<bool, Item>> itemOps;
+        vector<int> customerOrder;
+        vector<int> itemOrder;
+        CsvParser ps(mf.data, mf.data + mf.size);
+        while (ps.next()) {
+            STATS_ADD(CTR_RECORDS_SCANNED, 1);
+            const string_view* f = ps.fields.data();
+            size_t n = ps.fields.size();
+            int id;
+            if (ps.error || n < 2 || f[0].size() != 2 || !parse_int(f[1], id)) continue;
+            if (f[0][0] == 'C') {
+                floors[ID_CUSTOMER] = max(floors[ID_CUSTOMER], id + 1);
+                pair<bool, Customer> op(f[0][1] == '+', Customer());
+                if (op.first && !Customer::from_fields(f + 1, n - 1, op.second)) continue;
+                if (customerOps.insert(make_pair(id, op)).second) customerOrder.push_back(id);
+                else customerOps[id] = op;
+            } else if (f[0][0] == 'I') {
+                floors[ID_ITEM] = max(floors[ID_ITEM], id + 1);
+                pair<bool, Item> op(f[0][1] == '+', Item());
+                if (op.first && !Item::from_fields(f + 1, n - 1, op.second)) continue;
+                if (itemOps.insert(make_pair(id, op)).second) itemOrder.push_back(id);
+                else itemOps[id] = op;
+            }
+        }
+        apply_changes(customers, customerOps, customerOrder);
+        apply_changes(items, itemOps, itemOrder);
+        customers.compact_pool();
+        items.compact_pool();
+    }
+    uint64_t append_change(const string& entry) {
+        STATS_TIMER(OP_CHANGE_LOG_APPEND);
+        return writer.append(CHANGE_LOG_FILE, entry + "\n");
+    }
+    // Folds the log into new base files. Each base is written to a temporary
+    // file, synced and renamed over the old one before the log is truncated;
+    // replaying the old log over a new base is harmless, so a crash at any
+    // step leaves a loadable state. Changes logged meanwhile wait on the
+    // writer and land in the new log.
+    bool compact() {
+        STATS_TIMER(OP_COMPACT);
+        return writer.replace(CHANGE_LOG_FILE, [&] {
+            string data;
+            for (auto c : customers) data += c.to_csv() + "\n";
+            if (!write_file_atomic(CUSTOMERS_FILE, data)) return false;
+            data.clear();
+            for (auto it : catalog.latest().items) data += it.to_csv() + "\n";
+            if (!write_file_atomic(ITEMS_FILE, data)) return false;
+            return write_file_atomic(CHANGE_LOG_FILE, string());
+        });
+    }
+    void compact_data_files() {
+        FileStamp log = file_stamp(CHANGE_LOG_FILE);
+        if (log.size <= 0) { cout << "Nothing to compact.\n"; return; }
+        if (compact()) cout << "Compacted " << log.size << " bytes of changes into " << CUSTOMERS_FILE << " and " << ITEMS_FILE << ".\n";
+        else cout << "Compaction failed; changes remain in " << CHANGE_LOG_FILE << ".\n";
+    }
+    void shutdown() {
+        if (!writer.sync()) cout << "Warning: some changes could not be written to disk.\n";
+        rollups.save();
+        accounts.save();
+        if (file_stamp(CHANGE_LOG_FILE).size > COMPACT_LOG_THRESHOLD) compact();
+        save_snapshot();
+        ids.release();
+    }
+    uint64_t save_customer(const Customer& c) {
+        return append_change("C+," + c.to_csv());
+    }
+    uint64_t save_customer_removed(int id) {
+        return append_change("C-," + to_string(id));
+    }
+    uint64_t save_item(const Item& it) {
+        return append_change("I+," + it.to_csv());
+    }
+    uint64_t save_item_removed(int id) {
+        return append_change("I-," + to_string(id));
+    }
+    bool save_invoice(const Invoice& inv, const CustomerRow& c) {
+        STATS_TIMER(OP_SAVE_INVOICE);
+        const string* doc;
+        {
+            STATS_TIMER(OP_RENDER_INVOICE);
+            doc = &renderer.render(inv, c);
+        }
+        return writer.wait(store_invoice(inv, *doc));
+    }
+    static void report_write_failure() {
+        cout << "Write failed; the change is kept and will be retried. Check free disk space.\n";
+    }
+    static void report_id_failure() {
+        cout << "Could not reserve an id; nothing was saved. Check free disk space.\n";
+    }
+    // Queues the document, ledger record and meta row; the returned ticket
+    // covers all three.
+    uint64_t store_invoice(const Invoice& inv, const string& doc) {
+        ensure_invoices_folder();
+        {
+            STATS_TIMER(OP_WRITE_DOCUMENT);
+            documents.put(inv.id, doc);
+        }
+        InvoiceTotals t = inv.totals();
+        uint64_t offset = max<uint64_t>(ledger.ledgerSize, 2 * sizeof(uint32_t));
+        int dateKey = date_key(inv.date);
+        ledger.append(inv, t);
+        rollups.days[dateKey].add_invoice(t, inv.shipping);
+        rollups.watermark = ledger.ledgerSize;
+        accounts.add(inv.customerId, dateKey, t.total.minor, offset);
+        accounts.watermark = ledger.ledgerSize;
+        STATS_TIMER(OP_META_APPEND);
+        return writer.append(INVOICES_META_FILE, inv.meta_csv() + "\n");
+    }
+    // Batch form of store_invoice: documents, ledger records and meta rows
+    // each go to the writer in one append, under one ticket.
+    uint64_t store_invoices(const vector<Invoice>& invs, const vector<string>& docs) {
+        ensure_invoices_folder();
+        {
+            STATS_TIMER(OP_WRITE_DOCUMENT);
+            for (size_t i = 0; i < invs.size(); ++i) documents.append(invs[i].id, docs[i].data(), docs[i].size());
+            documents.flush(false);
+        }
+        uint64_t offset = max<uint64_t>(ledger.ledgerSize, 2 * sizeof(uint32_t));
+        string records, meta;
+        for (auto& inv : invs) {
+            InvoiceTotals t = inv.totals();
+            int dateKey = date_key(inv.date);
+            rollups.days[dateKey].add_invoice(t, inv.shipping);
+            accounts.add(inv.customerId, dateKey, t.total.minor, offset + records.size());
+            records += InvoiceLedger::encode(inv, t);
+            meta += inv.meta_csv();
+            meta += '\n';
+        }
+        ledger.append_records(records);
+        rollups.watermark = ledger.ledgerSize;
+        accounts.watermark = ledger.ledgerSize;
+        STATS_TIMER(OP_META_APPEND);
+        return writer.append(INVOICES_META_FILE, meta);
+    }
+    // Packed documents first, then a legacy invoices/invoice_<id>.txt file.
+    bool read_document(int id, string& out) {
+        if (documents.get(id, out)) return true;
+        string fname = INVOICES_FOLDER + "/invoice_" + to_string(id) + ".txt";
+        ifstream in(fname.c_str());
+        if (!in) return false;
+        out.assign((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+        STATS_ADD(CTR_FILES_OPENED, 1);
+        STATS_ADD(CTR_BYTES_READ, out.size());
+        return true;
+    }
+    // Length of a "%.2f" number at the start of s, or 0.
+    static size_t fixed2_length(string_view s) {
+        size_t i = 0;
+        while (i < s.size() && isdigit((unsigned char)s[i])) ++i;
+        if (i == 0 || i + 3 > s.size() || s[i] != '.' || !isdigit((unsigned char)s[i + 1]) || !isdigit((unsigned char)s[i + 2])) return 0;
+        return i + 3;
+    }
+    // One row of a legacy item table: No(6) Qty(8) Unit(10) Description(40)
+    // Tax%(10) LineTotal(14), left-aligned. A value wider than its column is
+    // printed in full with no separator, so numbers are read by their
+    // "%.2f" shape and the description ends where a Tax% that lines up with
+    // the LineTotal after it begins. The first row's quantity is in default
+    // float format and must fit its column.
+    static bool parse_legacy_line(string_view l, bool first, const unordered_map<string_view, int>& byDescription, InvoiceLines& lines) {
+        auto spaces = [&](size_t from, size_t to) { return l.find_first_not_of(' ', from) >= min(to, l.size()); };
+        if (l.size() < 6 || l[5] != ' ') return false;
+        size_t p = 6;
+        size_t n = !first ? fixed2_length(l.substr(p)) : l.size() > p + 7 && l[p + 7] == ' ' ? l.find(' ', p) - p : 0;
+        if (n == 0) return false;
+        string qty(l.substr(p, n));
+        char* end;
+        double q = strtod(qty.c_str(), &end);
+        if (*end || !spaces(p + n, p + 8)) return false;
+        InvoiceLine L;
+        p += max<size_t>(n, 8);
+        if (p > l.size() || (n = fixed2_length(l.substr(p))) == 0 || !Money::parse(l.substr(p, n), L.unitPrice) || !spaces(p + n, p + 10)) return false;
+        p += max<size_t>(n, 10);
+        int64_t bp = -1;
+        size_t k = p + 40;
+        for (; k < l.size(); ++k) {
+            size_t t = fixed2_length(l.substr(k));
+            size_t total = k + max<size_t>(t, 10);
+            size_t m = t && total < l.size() ? fixed2_length(l.substr(total)) : 0;
+            if (m && spaces(k + t, total) && spaces(total + m, l.size()) && parse_decimal(l.substr(k, t), 100, bp)) break;
+        }
+        if (bp < 0) return false;
+        string_view d = l.substr(p, k - p);
+        d = d.substr(0, d.find_last_not_of(' ') + 1);
+        auto f = byDescription.find(d);
+        L.itemId = f == byDescription.end() ? 0 : f->second;
+        L.description.assign(d);
+        L.quantity = scale_double(q, QTY_SCALE);
+        L.taxBp = (int32_t)bp;
+        lines.push_back(L);
+        return true;
+    }
+    // Legacy .txt invoices are read by layout: item rows sit between the two
+    // dashed rules and each total follows the second one on its own line,
+    // starting (after padding) with the label render_txt prints. The text has
+    // no item ids, so a line gets the id of the one catalog item with its
+    // description, or 0. Invoices whose item rows cannot be read keep their
+    // totals but no lines, and are counted in a warning.
+    void migrate_invoices_to_ledger(const vector<Invoice>& invoices) {
+        cout << "Building invoice ledger from " << invoices.size() << " existing invoice files...\n";
+        CatalogPin cat = catalog.pin();
+        unordered_map<string_view, int> byDescription;
+        for (auto it : cat->items) {
+            auto r = byDescription.insert(make_pair(it.description, it.id));
+            if (!r.second) r.first->second = 0;
+        }
+        const string rule(90, '-');
+        string doc;
+        size_t unreadable = 0;
+        for (auto& meta : invoices) {
+            if (!read_document(meta.id, doc)) continue;
+            istringstream in(doc);
+            Invoice inv = meta;
+            InvoiceTotals t;
+            string l;
+            int section = 0;
+            bool linesOk = true;
+            while (getline(in, l)) {
+                if (l == rule) { ++section; continue; }
+                if (section == 1) { linesOk = parse_legacy_line(l, inv.lines.size() == 0, byDescription, inv.lines) && linesOk; continue; }
+                if (section < 2) continue;
+                if (l.compare(0, 6, "Note: ") == 0) { inv.note = l.substr(6); continue; }
+                string_view v(l);
+                v.remove_prefix(min(v.find_first_not_of(' '), v.size()));
+                auto label = [&](const char* s) { return v.compare(0, strlen(s), s) == 0; };
+                Money val;
+                if (!Money::parse(v.substr(v.find_last_of(' ') + 1), val)) continue;
+                if (label("Subtotal: ")) t.subtotal = val;
+                else if (label("Tax: ")) t.tax = val;
+                else if (label("Discount (")) t.discount = -val;
+                else if (label("TOTAL: ")) t.total = val;
+            }
+            if (!linesOk || section < 2) {
+                inv.lines.clear();
+                ++unreadable;
+            }
+            ledger.append(inv, t);
+        }
+        if (unreadable) cout << "Warning: could not read the item lines of " << unreadable << " invoices; item and tax-rate analytics leave them out.\n";
+    }
+    void reindex_customers(size_t from) {
+        if (from == 0) {
+            customerById.clear();
+            customerById.reserve(customers.size());
+        }
+        for (size_t i = from; i < customers.size(); ++i) customerById[customers[i].id] = i;
+    }
+    CustomerRow find_customer(int id) {
+        STATS_SAMPLED_TIMER(OP_FIND_CUSTOMER);
+        auto f = customerById.find(id);
+        return f == customerById.end() ? CustomerRow() : customers[f->second];
+    }
+    // The returned row's strings live in the pinned snapshot's pool, which
+    // is freed with the snapshot once a compacted catalog replaces it, so
+    // the row is valid only while cat is held.
+    ItemRow find_item_by_id(const CatalogPin& cat, int id) {
+        STATS_SAMPLED_TIMER(OP_FIND_ITEM);
+        return cat->find(id);
+    }
+    ItemRow find_item_by_code(const CatalogPin& cat, string_view code) {
+        STATS_SAMPLED_TIMER(OP_FIND_ITEM);
+        return cat->find(code);
+    }
+    // Both return the write ticket, or 0 when no id could be reserved and
+    // nothing changed.
+    uint64_t insert_customer(Customer& c) {
+        c.id = ids.allocate(ID_CUSTOMER);
+        if (!c.id) return 0;
+        customers.push_back(c);
+        customerById[c.id] = customers.size() - 1;
+        if (customersByNameReady.load()) {
+            uint32_t pos = (uint32_t)customers.size() - 1;
+            customersByName.insert(upper_bound(customersByName.begin(), customersByName.end(), pos, [&](uint32_t a, uint32_t b) { return customer_name_less(a, b); }), pos);
+        }
+        customerSearch.add(c.id, search_text(c.name, c.email));
+        return save_customer(c);
+    }
+    void add_customer() {
+        Customer c;
+        c.name = input_line("Enter customer name: ");
+        c.address = input_line("Enter address: ");
+        c.email = input_line("Enter email: ");
+        c.phone = input_line("Enter phone: ");
+        uint64_t ticket = insert_customer(c);
+        if (!ticket) { report_id_failure(); return; }
+        if (!writer.wait(ticket)) { report_write_failure(); return; }
+        cout << "Customer saved with ID " << c.id << "\n";
+    }
+    bool customer_name_less(uint32_t a, uint32_t b) const {
+        string_view x = customers.name[a].view(), y = customers.name[b].view();
+        return x != y ? x < y : customers.id[a] < customers.id[b];
+    }
+    // Safe for concurrent readers; writers must have them locked out.
+    const vector<uint32_t>& customers_by_name() {
+        if (customersByNameReady.load()) return customersByName;
+        lock_guard<mutex> g(customersByNameLock);
+        if (!customersByNameReady.load()) {
+            customersByName.resize(customers.size());
+            for (size_t i = 0; i < customersByName.size(); ++i) customersByName[i] = (uint32_t)i;
+            sort(customersByName.begin(), customersByName.end(), [&](uint32_t a, uint32_t b) { return customer_name_less(a, b); });
+            customersByNameReady.store(true);
+        }
+        return customersByName;
+    }
+    void drop_customer_name_index() {
+        customersByNameReady.store(false);
+        vector<uint32_t>().swap(customersByName);
+    }
+    // Keyset pages: up to limit rows after the cursor, which then moves to
+    // the last row returned. Customers are ordered by name, items by SKU.
+    vector<CustomerRow> customer_page(ListCursor& after, size_t limit) {
+        const vector<uint32_t>& order = customers_by_name();
+        auto k = order.begin();
+        if (after.started) {
+            k = partition_point(order.begin(), order.end(), [&](uint32_t i) {
+                string_view name = customers.name[i].view();
+                return name != after.text ? name < after.text : customers.id[i] <= after.id;
+            });
+        }
+        vector<CustomerRow> rows;
+        for (; k != order.end() && rows.size() < limit; ++k) rows.push_back(customers[*k]);
+        after.more = k != order.end();
+        if (!rows.empty()) {
+            after.started = true;
+            after.text.assign(rows.back().name);
+            after.id = rows.back().id;
+        }
+        return rows;
+    }
+    // Rows are valid only while cat is held.
+    vector<ItemRow> item_page(const CatalogPin& cat, ListCursor& after, size_t limit) {
+        const vector<uint32_t>& order = cat->byCode;
+        const ItemTable& items = cat->items;
+        auto k = order.begin();
+        if (after.started) {
+            k = partition_point(order.begin(), order.end(), [&](uint32_t i) {
+                string_view code = items.code[i].view();
+                return code != after.text ? code < after.text : items.id[i] <= after.id;
+            });
+        }
+        vector<ItemRow> rows;
+        for (; k != order.end() && rows.size() < limit; ++k) rows.push_back(items[*k]);
+        after.more = k != order.end();
+        if (!rows.empty()) {
+            after.started = true;
+            after.text.assign(rows.back().code);
+            after.id = rows.back().id;
+        }
+        return rows;
+    }
+    // All invoices page by (date, id) through the ledger index. One
+    // customer's invoices page in the order they were saved through that
+    // customer's ledger offsets, with the offset as the cursor.
+    vector<LedgerRecordHeader> invoice_page(int customerId, ListCursor& after, size_t limit) {
+        vector<LedgerRecordHeader> rows;
+        ledger.wait_written();
+        ifstream lf(INVOICE_LEDGER_FILE.c_str(), ios::binary);
+        STATS_ADD(CTR_FILES_OPENED, 1);
+        LedgerRecordHeader h;
+        if (customerId == 0) {
+            const vector<LedgerIndexEntry>& index = ledger.index;
+            auto k = index.begin();
+            if (after.started) {
+                LedgerIndexEntry key = { (int32_t)after.number, after.id, 0, 0, 0 };
+                k = upper_bound(index.begin(), index.end(), key);
+            }
+            for (; k != index.end() && rows.size() < limit; ++k) {
+                if (ledger.read_header(lf, *k, h)) rows.push_back(h);
+                else lf.clear();
+            }
+            after.more = k != index.end();
+            if (!rows.empty()) after.number = rows.back().date;
+        } else {
+            auto f = accounts.invoiceOffsets.find(customerId);
+            static const vector<uint64_t> none;
+            const vector<uint64_t>& offsets = f == accounts.invoiceOffsets.end() ? none : f->second;
+            auto k = after.started ? upper_bound(offsets.begin(), offsets.end(), (uint64_t)after.number) : offsets.begin();
+            for (; k != offsets.end() && rows.size() < limit; ++k) {
+                STATS_ADD(CTR_RECORDS_SCANNED, 1);
+                STATS_ADD(CTR_BYTES_READ, sizeof(h));
+                lf.seekg(*k);
+                if (lf.read((char*)&h, sizeof(h)) && h.customerId == customerId) {
+                    rows.push_back(h);
+                    after.number = (int64_t)*k;
+                }
+                lf.clear();
+            }
+            after.more = k != offsets.end();
+        }
+        if (!rows.empty()) {
+            after.started = true;
+            after.id = rows.back().id;
+        }
+        return rows;
+    }
+    // Writes the page and, when more rows remain, asks whether to go on.
+    static bool next_page(TextBuffer& out, const ListCursor& cur) {
+        out.write_to(cout);
+        if (!cur.more) return false;
+        string s = input_line("Enter for the next page, q to stop: ");
+        return s.empty() && cin.good();
+    }
+    void list_customers() {
+        TextBuffer out;
+        char tmp[32];
+        out.put_left("ID", 6); out.put_left("Name", 30); out.put_left("Email", 30); out.put_left("Phone", 20); out.put('\n');
+        out.put('-', 90); out.put('\n');
+        ListCursor cur;
+        do {
+            for (auto& c : customer_page(cur, LIST_PAGE_SIZE)) {
+                out.put_left(TextBuffer::int_text(tmp, c.id), 6);
+                out.put_left(c.name, 30);
+                out.put_left(c.email, 30);
+                out.put_left(c.phone, 20);
+                out.put('\n');
+            }
+        } while (next_page(out, cur));
+    }
+    vector<int> query_customers(const string& q, size_t& total) {
+        STATS_TIMER(OP_SEARCH_CUSTOMERS);
+        return customerSearch.query(q, SEARCH_RESULT_LIMIT, total);
+    }
+    vector<int> query_items(const string& q, size_t& total) {
+        STATS_TIMER(OP_SEARCH_ITEMS);
+        return itemSearch.query(q, SEARCH_RESULT_LIMIT, total);
+    }
+    void search_customers() {
+        string q = input_line("Search by name or email: ");
+        size_t total = 0;
+        vector<int> matches = query_customers(q, total);
+        cout << left << setw(6) << "ID" << setw(30) << "Name" << setw(30) << "Email" << setw(20) << "Phone" << "\n";
+        cout << string(90, '-') << "\n";
+        for (int id : matches) {
+            CustomerRow c = find_customer(id);
+            cout << left << setw(6) << c.id << setw(30) << c.name << setw(30) << c.email << setw(20) << c.phone << "\n";
+        }
+        if (total > matches.size()) cout << "Showing top " << matches.size() << " of " << total << " matches.\n";
+    }
+    uint64_t insert_item(Item& it) {
+        it.id = ids.allocate(ID_ITEM);
+        uint32_t version = it.id ? (uint32_t)ids.allocate(ID_CATALOG) : 0;
+        if (!version) return 0;
+        catalog.update(version, [&](CatalogSnapshot& next) { next.push_back(it.row()); });
+        itemSearch.add(it.id, search_text(it.code, it.description));
+        return save_item(it);
+    }
+    // Bulk counterparts of insert_customer/insert_item. Nothing is logged; the
+    // caller compacts afterwards so the base files hold the result, and
+    // exits without compacting when either returns false for lack of ids.
+    bool import_customers(vector<Customer>& rows) {
+        if (rows.empty()) return true;
+        size_t first = customers.size();
+        int id = ids.allocate(ID_CUSTOMER, (int)rows.size());
+        if (!id) return false;
+        customers.reserve(first + rows.size());
+        for (auto& c : rows) {
+            c.id = id++;
+            customers.push_back(c);
+        }
+        reindex_customers(first);
+        drop_customer_name_index();
+        for (size_t i = first; i < customers.size(); ++i) {
+            CustomerRow c = customers[i];
+            customerSearch.add(c.id, search_text(c.name, c.email));
+        }
+        return true;
+    }
+    // Rows whose SKU already exists update that item; updated counts them.
+    // The whole batch is published as one catalog version.
+    bool import_items(vector<Item>& rows, size_t& updated) {
+        uint32_t version = (uint32_t)ids.allocate(ID_CATALOG);
+        if (!version) return false;
+        bool ok = true;
+        catalog.update(version, [&](CatalogSnapshot& next) {
+            next.items.reserve(next.items.size() + rows.size());
+            for (auto& row : rows) {
+                size_t pos = next.position(string_view(row.code));
+                if (pos != string::npos) {
+                    row.id = next.items.id[pos];
+                    next.set(pos, row.row());
+                    ++updated;
+                } else {
+                    row.id = ids.allocate(ID_ITEM);
+                    if (!row.id) { ok = false; break; }
+                    next.push_back(row.row());
+                }
+                itemSearch.add(row.id, search_text(row.code, row.description));
+            }
+        });
+        return ok;
+    }
+    void add_item() {
+        Item it;
+        it.code = input_line("Enter item code (SKU): ");
+        if (find_item_by_code(catalog.pin(), it.code)) { cout << "An item with SKU " << it.code << " already exists.\n"; return; }
+        it.description = input_line("Enter description: ");
+        it.unitPrice = Money::from_double(input_double("Enter unit price: "));
+        it.taxBp = (int32_t)scale_double(input_double("Enter tax percent: "), 100);
+        uint64_t ticket = insert_item(it);
+        if (!ticket) { report_id_failure(); return; }
+        if (!writer.wait(ticket)) { report_write_failure(); return; }
+        cout << "Item saved with ID " << it.id << "\n";
+    }
+    void list_items() {
+        TextBuffer out;
+        char tmp[32];
+        out.put_left("ID", 6); out.put_left("SKU", 12); out.put_left("Description", 40); out.put_left("Price", 12); out.put_left("Tax", 8); out.put('\n');
+        out.put('-', 80); out.put('\n');
+        CatalogPin cat = catalog.pin();
+        ListCursor cur;
+        do {
+            for (auto& it : item_page(cat, cur, LIST_PAGE_SIZE)) {
+                out.put_left(TextBuffer::int_text(tmp, it.id), 6);
+                out.put_left(it.code, 12);
+                out.put_left(it.description, 40);
+                out.put_left(TextBuffer::hundredths_text(tmp, it.unitPrice.minor), 12);
+                out.put_left(TextBuffer::hundredths_text(tmp, it.taxBp), 8);
+                out.put('\n');
+            }
+        } while (next_page(out, cur));
+    }
+    void search_items() {
+        string q = input_line("Search by SKU or description: ");
+        size_t total = 0;
+        vector<int> matches = query_items(q, total);
+        cout << left << setw(6) << "ID" << setw(12) << "SKU" << setw(40) << "Description" << setw(12) << "Price" << setw(8) << "Tax" << "\n";
+        cout << string(80, '-') << "\n";
+        CatalogPin cat = catalog.pin();
+        for (int id : matches) {
+            ItemRow it = find_item_by_id(cat, id);
+            cout << left << setw(6) << it.id << setw(12) << it.code << setw(40) << it.description << setw(12) << fixed << setprecision(2) << it.unitPrice.to_double() << setw(8) << it.taxPercent() << "\n";
+        }
+        if (total > matches.size()) cout << "Showing top " << matches.size() << " of " << total << " matches.\n";
+    }
+    static InvoiceLine invoice_line(const ItemRow& it, int64_t quantity) {
+        InvoiceLine L;
+        L.itemId = it.id;
+        L.description = it.description;
+        L.unitPrice = it.unitPrice;
+        L.taxBp = it.taxBp;
+        L.quantity = quantity;
+        return L;
+    }
+    // Every line is priced from the catalog version pinned here, even if
+    // items change while the invoice is being entered.
+    void create_invoice() {
+        if (customers.empty()) { cout << "No customers defined. Add customer first.\n"; return; }
+        CatalogPin cat = catalog.pin();
+        if (cat->items.empty()) { cout << "No items defined. Add items first.\n"; return; }
+        Invoice inv;
+        inv.catalogVersion = cat->version;
+        int cid = input_int("Enter customer ID: ");
+        CustomerRow c = find_customer(cid);
+        if (!c) { cout << "Customer not found.\n"; return; }
+        inv.customerId = cid;
+        inv.date = now_date();
+        inv.note = "";
+        inv.discountBp = 0;
+        inv.shipping = Money();
+        while (true) {
+            string yn = input_line("Add line? (y/n): ");
+            if (yn.empty() || (yn[0] != 'y' && yn[0] != 'Y')) break;
+            ItemRow it = cat->resolve(input_line("Enter SKU or item ID: "));
+            if (!it) { cout << "Item not found. Try again.\n"; continue; }
+            InvoiceLine L = invoice_line(it, scale_double(input_double("Enter quantity: "), QTY_SCALE));
+            if (!inv.lines.fits(L)) { cout << "Line amount too large. Try again.\n"; continue; }
+            inv.lines.push_back(L);
+        }
+        inv.discountBp = (int32_t)scale_double(input_double("Enter discount percent (0 for none): ", true, 0.0), 100);
+        inv.shipping = Money::from_double(input_double("Enter shipping amount: ", true, 0.0));
+        inv.note = input_line("Enter optional note: ");
+        taxes.apply(inv.lines, *cat, c.address, date_key(inv.date));
+        inv.id = ids.allocate(ID_INVOICE);
+        if (!inv.id) { report_id_failure(); return; }
+        if (!save_invoice(inv, c)) { report_write_failure(); return; }
+        cout << "Invoice " << inv.id << " created and saved to " << DocumentStore::segment_path(documents.segment) << "\n";
+    }
+    void list_invoices_meta() {
+        int customerId = input_int("Customer ID (blank for all): ", true, 0);
+        if (ledger.index.empty()) { cout << "No invoices found.\n"; return; }
+        TextBuffer out;
+        char tmp[32];
+        out.put_left("InvID", 8); out.put_left("CustID", 10); out.put_left("Date", 15); out.put_left("Discount", 12); out.put_left("Shipping", 12); out.put("Catalog\n");
+        out.put('-', 68); out.put('\n');
+        ListCursor cur;
+        do {
+            for (auto& h : invoice_page(customerId, cur, LIST_PAGE_SIZE)) {
+                out.put_left(TextBuffer::int_text(tmp, h.id), 8);
+                out.put_left(TextBuffer::int_text(tmp, h.customerId), 10);
+                out.put_left(date_from_key(h.date), 15);
+                out.put_left(TextBuffer::hundredths_text(tmp, h.discountBp), 12);
+                out.put_left(TextBuffer::hundredths_text(tmp, h.shipping), 12);
+                out.put(TextBuffer::int_text(tmp, h.catalogVersion));
+                out.put('\n');
+            }
+        } while (next_page(out, cur));
+    }
+    void view_invoice_file() {
+        string s = input_line("Enter invoice ID to view: ");
+        int id;
+        string content;
+        if (!parse_int(s, id) || !read_document(id, content)) { cout << "Invoice file not found.\n"; return; }
+        cout << content << "\n";
+    }
+    void export_report_sales() {
+        string start = input_line("Enter start date (YYYY-MM-DD): ");
+        string end = input_line("Enter end date (YYYY-MM-DD): ");
+        int startKey = date_key(start);
+        int endKey = date_key(end);
+        if (startKey < 0 || endKey < 0) { cout << "Invalid date. Use YYYY-MM-DD.\n"; return; }
+        sales_report(startKey, endKey, cout);
+    }
+    // Day and month groups come from the rollups; the rest scan the ledger
+    // in parallel.
+    map<int64_t, SalesAggregate> analyze(int startKey, int endKey, SalesGroup g) {
+        STATS_TIMER(OP_SALES_ANALYTICS);
+        if (g == GROUP_DAY || g == GROUP_MONTH) return rollups.range(startKey, endKey, g);
+        pair<size_t, size_t> range = ledger.date_range(startKey, endKey);
+        ledger.wait_written();
+        return parallel_aggregate(ledger.index, range.first, range.second, g);
+    }
+    string group_label(SalesGroup g, int64_t key) {
+        char buf[32];
+        if (g == GROUP_DAY) return date_from_key((int)key);
+        if (g == GROUP_MONTH) {
+            snprintf(buf, sizeof(buf), "%04d-%02d", (int)(key / 100), (int)(key % 100));
+            return buf;
+        }
+        if (g == GROUP_TAX_RATE) return format_hundredths(key) + "%";
+        string label = to_string(key);
+        if (g == GROUP_CUSTOMER) {
+            CustomerRow c = find_customer((int)key);
+            if (c) label += " " + string(c.name);
+        } else {
+            CatalogPin cat = catalog.pin();
+            ItemRow it = find_item_by_id(cat, (int)key);
+            if (it) label += " " + string(it.code);
+        }
+        return label.substr(0, 29);
+    }
+    SalesAggregate sales_analytics(int startKey, int endKey, SalesGroup g, ostream& out) {
+        map<int64_t, SalesAggregate> groups = analyze(startKey, endKey, g);
+        bool lines = g == GROUP_ITEM || g == GROUP_TAX_RATE;
+        SalesAggregate sum;
+        if (lines) out << left << setw(30) << SALES_GROUP_NAMES[g] << right << setw(10) << "Lines" << setw(14) << "Quantity" << setw(16) << "Net" << setw(14) << "Tax" << "\n";
+        else out << left << setw(30) << SALES_GROUP_NAMES[g] << right << setw(10) << "Invoices" << setw(16) << "Subtotal" << setw(14) << "Tax" << setw(14) << "Discount" << setw(12) << "Shipping" << setw(16) << "Total" << "\n";
+        out << string(lines ? 84 : 112, '-') << "\n";
+        auto row = [&](const string& label, const SalesAggregate& a) {
+            if (lines) {
+                out << left << setw(30) << label << right << setw(10) << a.count << setw(14) << format_hundredths(round_div(a.quantity, QTY_SCALE / 100))
+                    << setw(16) << format_hundredths(a.subtotal) << setw(14) << format_hundredths(a.tax) << "\n";
+            } else {
+                out << left << setw(30) << label << right << setw(10) << a.count << setw(16) << format_hundredths(a.subtotal)
+                    << setw(14) << format_hundredths(a.tax) << setw(14) << format_hundredths(a.discount) << setw(12) << format_hundredths(a.shipping)
+                    << setw(16) << format_hundredths(a.total) << "\n";
+            }
+        };
+        for (auto& kv : groups) {
+            row(group_label(g, kv.first), kv.second);
+            sum.merge(kv.second);
+        }
+        out << string(lines ? 84 : 112, '-') << "\n";
+        row("TOTAL", sum);
+        return sum;
+    }
+    void export_sales_analytics() {
+        int startKey = date_key(input_line("Enter start date (YYYY-MM-DD): "));
+        int endKey = date_key(input_line("Enter end date (YYYY-MM-DD): "));
+        if (startKey < 0 || endKey < 0) { cout << "Invalid date. Use YYYY-MM-DD.\n"; return; }
+        string by = input_line("Group by (customer/day/month/item/tax): ");
+        for (int g = GROUP_CUSTOMER; g <= GROUP_TAX_RATE; ++g) {
+            if (by == SALES_GROUP_NAMES[g]) { sales_analytics(startKey, endKey, (SalesGroup)g, cout); return; }
+        }
+        cout << "Unknown grouping.\n";
+    }
+    // Reads only this customer's ledger records, via the account index.
+    bool customer_statement(int customerId, ostream& out) {
+        CustomerRow c = find_customer(customerId);
+        if (!c) return false;
+        const CustomerAccount* a = accounts.find(customerId);
+        out << "Statement for customer " << c.id << " - " << c.name << "\n";
+        out << c.address << " | " << c.email << " | " << c.phone << "\n";
+        out << string(60, '-') << "\n";
+        if (!a) { out << "No invoices.\n"; return true; }
+        out << left << setw(20) << "Invoices:" << a->invoiceCount << "\n";
+        out << left << setw(20) << "Lifetime total:" << format_hundredths(a->lifetimeTotal) << "\n";
+        out << left << setw(20) << "Last invoice:" << date_from_key(a->lastInvoiceDate) << "\n\n";
+        out << left << setw(12) << "Period" << right << setw(16) << "Total" << "\n";
+        char period[16];
+        for (auto& m : a->months) {
+            snprintf(period, sizeof(period), "%04d-%02d", m.first / 100, m.first % 100);
+            out << left << setw(12) << period << right << setw(16) << format_hundredths(m.second) << "\n";
+        }
+        out << "\n" << left << setw(8) << "InvID" << setw(12) << "Date" << right << setw(14) << "Subtotal" << setw(12) << "Tax"
+            << setw(12) << "Discount" << setw(14) << "Total" << "\n";
+        out << string(72, '-') << "\n";
+        auto f = accounts.invoiceOffsets.find(customerId);
+        static const vector<uint64_t> none;
+        const vector<uint64_t>& offsets = f == accounts.invoiceOffsets.end() ? none : f->second;
+        ledger.wait_written();
+        ifstream lf(INVOICE_LEDGER_FILE.c_str(), ios::binary);
+        STATS_ADD(CTR_FILES_OPENED, 1);
+        vector<LedgerRecordHeader> rows;
+        rows.reserve(offsets.size());
+        LedgerRecordHeader h;
+        for (uint64_t off : offsets) {
+            STATS_ADD(CTR_RECORDS_SCANNED, 1);
+            STATS_ADD(CTR_BYTES_READ, sizeof(h));
+            lf.seekg(off);
+            if (!lf.read((char*)&h, sizeof(h)) || h.customerId != customerId) { lf.clear(); continue; }
+            rows.push_back(h);
+        }
+        sort(rows.begin(), rows.end(), [](const LedgerRecordHeader& x, const LedgerRecordHeader& y) {
+            return x.date != y.date ? x.date < y.date : x.id < y.id;
+        });
+        for (auto& r : rows) {
+            out << left << setw(8) << r.id << setw(12) << date_from_key(r.date) << right << setw(14) << format_hundredths(r.subtotal)
+                << setw(12) << format_hundredths(r.tax) << setw(12) << format_hundredths(r.discount) << setw(14) << format_hundredths(r.total) << "\n";
+        }
+        return true;
+    }
+    // Estimated bytes held for each table, counting its string pool and the
+    // id, name, SKU and search indexes built over it.
+    // The name index counts only once built: until then another reader may
+    // be building it under customersByNameLock.
+    size_t customer_memory() const {
+        size_t byName = customersByNameReady.load() ? customersByName.capacity() * sizeof(uint32_t) : 0;
+        return customers.memory() + hash_table_bytes(customerById) + byName + customerSearch.memory();
+    }
+    size_t item_memory() const {
+        return catalog.latest().memory() + itemSearch.memory();
+    }
+    void show_memory() const {
+        size_t c = customer_memory(), i = item_memory();
+        cout << "\nMemory\n";
+        cout << left << setw(12) << "customers" << right << setw(14) << c << " bytes" << setw(10) << c / max<size_t>(1, customers.size()) << " per record\n";
+        cout << left << setw(12) << "items" << right << setw(14) << i << " bytes" << setw(10) << i / max<size_t>(1, catalog.latest().items.size()) << " per record\n";
+        if (size_t rss = resident_bytes()) cout << left << setw(12) << "resident" << right << setw(14) << rss << " bytes\n";
+    }
+    void show_customer_statement() {
+        int id = input_int("Enter customer ID: ");
+        if (!customer_statement(id, cout)) cout << "Customer not found.\n";
+    }
+    Money sales_report(int startKey, int endKey, ostream& out) {
+        STATS_TIMER(OP_SALES_REPORT);
+        Money totalSales;
+        ledger.wait_written();
+        ifstream lf(INVOICE_LEDGER_FILE.c_str(), ios::binary);
+        STATS_ADD(CTR_FILES_OPENED, 1);
+        if (!lf || ledger.index.empty()) { out << "No invoices found.\n"; return totalSales; }
+        out << left << setw(8) << "InvID" << setw(10) << "CustID" << setw(12) << "Date" << setw(12) << "Total" << "\n";
+        out << string(50, '-') << "\n";
+        pair<size_t, size_t> range = ledger.date_range(startKey, endKey);
+        LedgerRecordHeader h;
+        for (size_t i = range.first; i < range.second; ++i) {
+            if (!ledger.read_header(lf, ledger.index[i], h)) { lf.clear(); continue; }
+            Money val = Money::cents(h.total);
+            out << left << setw(8) << h.id << setw(10) << h.customerId << setw(12) << date_from_key(h.date) << setw(12) << val.str() << "\n";
+            totalSales += val;
+        }
+        out << string(50, '-') << "\n";
+        out << left << setw(30) << "TOTAL SALES: " << setw(12) << totalSales.str() << "\n";
+        return totalSales;
+    }
+    void remove_customer() {
+        int id = input_int("Enter customer ID to remove: ");
+        auto f = customerById.find(id);
+        if (f == customerById.end()) { cout << "Not found.\n"; return; }
+        size_t pos = f->second;
+        customerById.erase(f);
+        customerSearch.remove(id);
+        customers.erase(pos);
+        customers.compact_pool();
+        reindex_customers(pos);
+        if (customersByNameReady.load()) {
+            customersByName.erase(std::find(customersByName.begin(), customersByName.end(), (uint32_t)pos));
+            for (auto& i : customersByName) {
+                if (i > pos) --i;
+            }
+        }
+        if (!writer.wait(save_customer_removed(id))) { report_write_failure(); return; }
+        cout << "Customer removed.\n";
+    }
+    void remove_item() {
+        int id = input_int("Enter item ID to remove: ");
+        size_t pos = catalog.latest().position(id);
+        if (pos == string::npos) { cout << "Not found.\n"; return; }
+        uint32_t version = (uint32_t)ids.allocate(ID_CATALOG);
+        if (!version) { report_id_failure(); return; }
+        itemSearch.remove(id);
+        catalog.update(version, [&](CatalogSnapshot& next) { next.erase(pos); });
+        if (!writer.wait(save_item_removed(id))) { report_write_failure(); return; }
+        cout << "Item removed.\n";
+    }
+};
+
+struct CommandOptions {
+    map<string, string> values;
+    bool parse(int argc, char** argv, int first) {
+        for (int i = first; i < argc; ++i) {
+            string key = argv[i];
+            if (key.compare(0, 2, "--") != 0 || i + 1 >= argc) {
+                cerr << "Expected --option value, got '" << key << "'\n";
+                return false;
+            }
+            values[key.substr(2)] = argv[++i];
+        }
+        return true;
+    }
+    string get(const string& key, const string& def) const {
+        auto f = values.find(key);
+        return f == values.end() ? def : f->second;
+    }
+    // A value that is not a whole number ends the program with status 2,
+    // like any other malformed command line.
+    long long get_int(const string& key, long long def) const {
+        auto f = values.find(key);
+        if (f == values.end()) return def;
+        const string& v = f->second;
+        long long n = 0;
+        const char* first = v.c_str() + (!v.empty() && v[0] == '+');
+        auto r = from_chars(first, v.c_str() + v.size(), n);
+        if (v.empty() || r.ec != errc() || r.ptr != v.c_str() + v.size()) {
+            cerr << "Invalid --" << key << " '" << v << "': expected a whole number\n";
+            exit(2);
+        }
+        return n;
+    }
+};
+
+// --compress, --commit-window-us, --commit-batch and --fsync.
+void configure_storage(BillingSystem& bs, const CommandOptions& opt) {
+    bs.documents.compress = opt.get_int("compress", 0) != 0;
+    bs.writer.configure(opt.get_int("commit-window-us", 0), opt.get_int("commit-batch", 1024), opt.get_int("fsync", 1) != 0);
+}
+
+struct Rng {
+    uint64_t state;
+    explicit Rng(uint64_t seed) : state(seed) {}
+    uint64_t next() {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+    uint64_t below(uint64_t n) { return n ? next() % n : 0; }
+    template <size_t N>
+    const char* pick(const char* const (&words)[N]) { return words[below(N)]; }
+};
+
+int64_t days_from_civil(int y, int m, int d) {
+    y -= m <= 2;
+    int64_t era = (y >= 0 ? y : y - 399) / 400;
+    int64_t yoe = y - era * 400;
+    int64_t doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+int date_key_from_days(int64_t z) {
+    z += 719468;
+    int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+    int64_t doe = z - era * 146097;
+    int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    int64_t mp = (5 * doy + 2) / 153;
+    int d = (int)(doy - (153 * mp + 2) / 5 + 1);
+    int m = (int)(mp < 10 ? mp + 3 : mp - 9);
+    int y = (int)(yoe + era * 400 + (m <= 2));
+    return y * 10000 + m * 100 + d;
+}
+
+static const char* const GEN_FIRST[] = { "Ali", "Sara", "John", "Maria", "Reza", "Lena", "Omar", "Yuki", "Chen", "Ana", "Peter", "Nina", "Karim", "Zoe", "Ivan", "Mina" };
+static const char* const GEN_LAST[] = { "Karimi", "Smith", "Garcia", "Muller", "Rossi", "Tanaka", "Novak", "Haddad", "Silva", "Jensen", "Ahmadi", "Brown", "Kowalski", "Moreau" };
+static const char* const GEN_STREET[] = { "Market Street", "Park Avenue", "Station Road", "Hill Lane", "River Walk", "Main Street", "Oak Drive", "Valiasr Street" };
+static const char* const GEN_CITY[] = { "Tehran", "Berlin", "Madrid", "Osaka", "Toronto", "Lyon", "Krakow", "Porto", "Austin", "Shiraz" };
+static const char* const GEN_ADJ[] = { "Premium", "Basic", "Heavy", "Compact", "Steel", "Organic", "Wireless", "Large", "Small", "Classic" };
+static const char* const GEN_NOUN[] = { "Bolt", "Cable", "Chair", "Lamp", "Filter", "Notebook", "Valve", "Bracket", "Battery", "Panel", "Sensor", "Hose" };
+static const int32_t GEN_TAX_BP[] = { 0, 500, 800, 900, 1500, 1900 };
+
+// Every generated record is a pure function of (seed, id), so datasets are
+// reproducible and records can be regenerated without keeping them around.
+Customer generate_customer(uint64_t seed, int id) {
+    Rng r(seed * 1000003 + (uint64_t)id);
+    Customer c;
+    c.id = id;
+    string first = r.pick(GEN_FIRST);
+    string last = r.pick(GEN_LAST);
+    c.name = first + " " + last;
+    c.address = to_string(1 + r.below(999)) + " " + r.pick(GEN_STREET) + " " + r.pick(GEN_CITY);
+    c.email = first + "." + last + to_string(id) + "@example.com";
+    for (auto& ch : c.email) ch = (char)tolower((unsigned char)ch);
+    c.phone = "+1-555-" + to_string(1000000 + r.below(9000000));
+    return c;
+}
+
+Item generate_item(uint64_t seed, int id, int ordinal) {
+    Rng r(seed * 7919 + (uint64_t)id);
+    Item it;
+    char sku[32];
+    snprintf(sku, sizeof(sku), "SKU-%07d", ordinal);
+    it.id = id;
+    it.code = sku;
+    it.description = string(r.pick(GEN_ADJ)) + " " + r.pick(GEN_NOUN) + " " + to_string(r.below(1000));
+    it.unitPrice = Money::cents(50 + (int64_t)r.below(r.below(10) == 0 ? 500000 : 20000));
+    it.taxBp = GEN_TAX_BP[r.below(sizeof(GEN_TAX_BP) / sizeof(GEN_TAX_BP[0]))];
+    return it;
+}
+
+struct ChunkedWriter {
+    ofstream out;
+    string buf;
+    explicit ChunkedWriter(const string& path) : out(path.c_str(), ios::binary | ios::trunc) {}
+    ~ChunkedWriter() { flush(); }
+    void line(const string& s) {
+        buf += s;
+        buf += '\n';
+        if (buf.size() >= (1 << 20)) flush();
+    }
+    void flush() {
+        out.write(buf.data(), buf.size());
+        buf.clear();
+    }
+};
+
+int run_generate(const CommandOptions& opt) {
+    long long nCustomers = opt.get_int("customers", 10000);
+    long long nItems = opt.get_int("items", 2000);
+    long long nInvoices = opt.get_int("invoices", 50000);
+    uint64_t seed = (uint64_t)opt.get_int("seed", 42);
+    bool documents = opt.get_int("documents", 1) != 0;
+    int64_t startDay = days_from_civil(2020, 1, 1);
+    int64_t spanDays = opt.get_int("years", 5) * 365;
+    if (nCustomers <= 0 || nItems <= 0 || nInvoices < 0) { cerr << "customers and items must be positive\n"; return 1; }
+    const string stale[] = { CHANGE_LOG_FILE, SNAPSHOT_FILE, INVOICE_LEDGER_FILE, INVOICE_LEDGER_INDEX_FILE, ROLLUP_FILE, ACCOUNTS_FILE, BILLING_RUNS_FILE, ID_COUNTERS_FILE };
+    for (auto& f : stale) remove(f.c_str());
+    DocumentStore::remove_files();
+    {
+        ChunkedWriter w(CUSTOMERS_FILE);
+        for (long long i = 0; i < nCustomers; ++i) w.line(generate_customer(seed, 1001 + (int)i).to_csv());
+    }
+    vector<Item> items;
+    {
+        ChunkedWriter w(ITEMS_FILE);
+        for (long long i = 0; i < nItems; ++i) {
+            items.push_back(generate_item(seed, 5001 + (int)i, (int)i));
+            w.line(items.back().to_csv());
+        }
+    }
+    make_directory(INVOICES_FOLDER);
+    InvoiceLedger ledger;
+    InvoiceRenderer renderer;
+    DocumentStore store;
+    store.compress = opt.get_int("compress", 0) != 0;
+    ChunkedWriter meta(INVOICES_META_FILE);
+    string records;
+    Rng r(seed);
+    for (long long i = 0; i < nInvoices; ++i) {
+        Invoice inv;
+        inv.id = 9001 + (int)i;
+        inv.customerId = 1001 + (int)r.below(nCustomers);
+        inv.date = date_from_key(date_key_from_days(startDay + i * spanDays / max(1LL, nInvoices)));
+        size_t nLines = 1 + r.below(8);
+        for (size_t k = 0; k < nLines; ++k) {
+            const Item& it = items[r.below(items.size())];
+            InvoiceLine L;
+            L.itemId = it.id;
+            L.description = it.description;
+            L.unitPrice = it.unitPrice;
+            L.taxBp = it.taxBp;
+            L.quantity = r.below(10) == 0 ? (int64_t)(250 + r.below(5000)) : (int64_t)(1 + r.below(20)) * QTY_SCALE;
+            inv.lines.push_back(L);
+        }
+        inv.discountBp = r.below(5) == 0 ? (int32_t)(500 * (1 + r.below(3))) : 0;
+        inv.shipping = Money::cents(r.below(3) == 0 ? 0 : 499 + 500 * (int64_t)r.below(3));
+        records += InvoiceLedger::encode(inv, inv.totals());
+        meta.line(inv.meta_csv());
+        if (documents) {
+            const string& doc = renderer.render(inv, generate_customer(seed, inv.customerId).row());
+            store.append(inv.id, doc.data(), doc.size());
+            if (store.pendingData.size() >= (4 << 20)) store.flush(false);
+        }
+        if (records.size() >= (4 << 20)) {
+            ledger.append_records(records);
+            records.clear();
+        }
+    }
+    if (!records.empty()) ledger.append_records(records);
+    store.flush(false);
+    cout << "Generated " << nCustomers << " customers, " << nItems << " items, " << nInvoices << " invoices (seed " << seed << ").\n";
+    return 0;
+}
+
+// Moves invoices/invoice_<id>.txt files listed in the meta file into the
+// document segments. Files are removed only after their batch is synced.
+int run_pack_invoices(const CommandOptions& opt) {
+    bool keep = opt.get_int("keep", 0) != 0;
+    DocumentStore store;
+    store.compress = opt.get_int("compress", 1) != 0;
+    store.load();
+    vector<int> ids;
+    MappedFile mf;
+    if (mf.open(INVOICES_META_FILE)) {
+        string_view f[1];
+        for_each_line(mf.data, mf.data + mf.size, [&](string_view line) {
+            int id;
+            if (split_fields(line, f, 1) && parse_int(f[0], id)) ids.push_back(id);
+        });
+    }
+    mf.close();
+    vector<string> packed;
+    uint64_t rawBytes = 0;
+    size_t count = 0;
+    auto commit = [&]() {
+        if (!store.flush(true)) { cerr << "Could not write " << DocumentStore::segment_path(store.segment) << "\n"; return false; }
+        if (!keep) for (auto& f : packed) remove(f.c_str());
+        packed.clear();
+        return true;
+    };
+    for (int id : ids) {
+        string fname = INVOICES_FOLDER + "/invoice_" + to_string(id) + ".txt";
+        ifstream in(fname.c_str(), ios::binary);
+        if (!in) continue;
+        packed.push_back(fname);
+        if (store.contains(id)) continue;
+        string doc((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+        store.append(id, doc.data(), doc.size());
+        rawBytes += doc.size();
+        ++count;
+        if (store.pendingData.size() >= (4 << 20) && !commit()) return 1;
+    }
+    if (!commit()) return 1;
+    uint64_t stored = 0;
+    for (uint32_t n = 1; n <= store.segment; ++n) stored += max<int64_t>(0, file_stamp(DocumentStore::segment_path(n)).size);
+    cout << "Packed " << count << " invoices (" << rawBytes << " bytes) into " << store.segment << " segment(s); "
+         << store.index.size() << " documents, " << stored << " bytes on disk.\n";
+    return 0;
+}
+
+template <class Row, class F>
+bool import_csv_file(const string& path, bool header, size_t threads, F parse, vector<Row>& rows, vector<CsvReject>& rejects) {
+    MappedFile mf;
+    if (!mf.open(path)) {
+        cerr << "Could not open " << path << "\n";
+        return false;
+    }
+    CsvParser ps(mf.data, mf.data + mf.size);
+    if (header) ps.next();
+    parse_csv_parallel(ps.p, ps.end, ps.line, threads, parse, rows, rejects);
+    return true;
+}
+
+// Bulk import for customer migrations and supplier price lists. Customer rows
+// are name,address,email,phone and get new ids; item rows are
+// sku,description,price,tax and update the item with that SKU or add one.
+// Rejected rows are reported as file:line: reason.
+int run_import(const CommandOptions& opt) {
+    string customersPath = opt.get("customers", "");
+    string itemsPath = opt.get("items", "");
+    if (customersPath.empty() && itemsPath.empty()) {
+        cerr << "--import needs --customers FILE and/or --items FILE\n";
+        return 2;
+    }
+    bool header = opt.get_int("header", 0) != 0;
+    size_t threads = (size_t)max<long long>(1, opt.get_int("threads", thread::hardware_concurrency()));
+    auto t0 = chrono::steady_clock::now();
+    vector<Customer> customers;
+    vector<Item> items;
+    vector<pair<string, vector<CsvReject>>> rejects;
+    if (!customersPath.empty()) {
+        rejects.push_back(make_pair(customersPath, vector<CsvReject>()));
+        bool ok = import_csv_file(customersPath, header, threads, [](const string_view* f, size_t n, Customer& c) -> const char* {
+            if (n != 4) return "expected 4 fields: name,address,email,phone";
+            if (f[0].empty()) return "empty name";
+            c.name.assign(f[0]);
+            c.address.assign(f[1]);
+            c.email.assign(f[2]);
+            c.phone.assign(f[3]);
+            return nullptr;
+        }, customers, rejects.back().second);
+        if (!ok) return 1;
+    }
+    if (!itemsPath.empty()) {
+        rejects.push_back(make_pair(itemsPath, vector<CsvReject>()));
+        bool ok = import_csv_file(itemsPath, header, threads, [](const string_view* f, size_t n, Item& it) -> const char* {
+            int64_t bp;
+            if (n != 4) return "expected 4 fields: sku,description,price,tax";
+            if (f[0].empty()) return "empty SKU";
+            if (!Money::parse(f[2], it.unitPrice)) return "invalid price";
+            if (!parse_decimal(f[3], 100, bp)) return "invalid tax";
+            it.code.assign(f[0]);
+            it.description.assign(f[1]);
+            it.taxBp = (int32_t)bp;
+            return nullptr;
+        }, items, rejects.back().second);
+        if (!ok) return 1;
+    }
+    auto t1 = chrono::steady_clock::now();
+    BillingSystem bs;
+    configure_storage(bs, opt);
+    size_t newCustomers = customers.size(), updated = 0;
+    if (!bs.import_customers(customers) || !bs.import_items(items, updated)) {
+        cerr << "Could not reserve ids in " << ID_COUNTERS_FILE << "; nothing was imported.\n";
+        return 1;
+    }
+    if ((newCustomers || !items.empty()) && !bs.compact()) {
+        cerr << "Could not write " << CUSTOMERS_FILE << " and " << ITEMS_FILE << "\n";
+        return 1;
+    }
+    bs.shutdown();
+    string rejectsPath = opt.get("rejects", "");
+    ofstream rejectsFile;
+    if (!rejectsPath.empty()) rejectsFile.open(rejectsPath.c_str());
+    size_t rejected = 0;
+    for (auto& file : rejects) {
+        for (auto& r : file.second) {
+            if (rejectsFile.is_open()) rejectsFile << file.first << ":" << r.line << ": " << r.reason << "\n";
+            else if (rejected < 20) cerr << file.first << ":" << r.line << ": " << r.reason << "\n";
+            ++rejected;
+        }
+    }
+    if (!rejectsFile.is_open() && rejected > 20) cerr << "... " << rejected - 20 << " more rejected rows (use --rejects FILE)\n";
+    auto ms = [](chrono::steady_clock::duration d) { return (long long)chrono::duration_cast<chrono::milliseconds>(d).count(); };
+    cout << "Imported " << newCustomers << " customers and " << items.size() << " items (" << items.size() - updated << " new, "
+         << updated << " updated); " << rejected << " rows rejected. Parse " << ms(t1 - t0) << " ms, total "
+         << ms(chrono::steady_clock::now() - t0) << " ms.\n";
+    return 0;
+}
+
+// Billing periods are months counted from year 0, written YYYY-MM.
+int parse_period(string_view s) {
+    int year, month;
+    if (s.size() != 7 || s[4] != '-' || !parse_int(s.substr(0, 4), year) || !parse_int(s.substr(5), month) || month < 1 || month > 12) return -1;
+    return year * 12 + month - 1;
+}
+
+// One row of subscriptions.csv: customer,item,quantity,cycle[,first period].
+// The item is a SKU or id, the cycle monthly, quarterly, yearly or a number
+// of months. Without a first period the cycle is aligned to the calendar
+// year, so a quarterly subscription is due in January, April, July and
+// October.
+struct Subscription {
+    int customerId;
+    string item;
+    int64_t quantity;
+    int months;
+    int firstPeriod;
+    bool due(int period) const {
+        int since = period - max(firstPeriod, 0);
+        return since >= 0 && since % months == 0;
+    }
+    static const char* parse(const string_view* f, size_t n, Subscription& s) {
+        if (n != 4 && n != 5) return "expected 4 or 5 fields: customer,item,quantity,cycle[,first period]";
+        if (!parse_int(f[0], s.customerId)) return "invalid customer id";
+        if (f[1].empty()) return "empty item";
+        if (!parse_decimal(f[2], QTY_SCALE, s.quantity) || s.quantity <= 0) return "invalid quantity";
+        if (f[3] == "monthly") s.months = 1;
+        else if (f[3] == "quarterly") s.months = 3;
+        else if (f[3] == "yearly") s.months = 12;
+        else if (!parse_int(f[3], s.months) || s.months < 1) return "invalid cycle";
+        s.firstPeriod = n == 5 && !f[4].empty() ? parse_period(f[4]) : -1;
+        if (n == 5 && !f[4].empty() && s.firstPeriod < 0) return "invalid first period, use YYYY-MM";
+        s.item.assign(f[1]);
+        return nullptr;
+    }
+};
+
+// billing_runs.csv is the checkpoint of every billing run: period, the ledger
+// size when the run started, invoices written so far and whether it
+// finished. Invoices of a run carry its note, so a rerun of the period skips
+// the customers that already have such an invoice past the start offset;
+// an interrupted run therefore resumes without duplicating or skipping
+// anyone.
+struct BillingRunLog {
+    struct Run {
+        string period;
+        uint64_t startOffset;
+        int invoices;
+        bool done;
+    };
+    vector<Run> runs;
+
+    void load() {
+        runs.clear();
+        MappedFile mf;
+        if (!mf.open(BILLING_RUNS_FILE)) return;
+        CsvParser ps(mf.data, mf.data + mf.size);
+        while (ps.next()) {
+            const vector<string_view>& f = ps.fields;
+            Run r;
+            if (ps.error || f.size() != 4 || !parse_int(f[2], r.invoices)) continue;
+            r.period.assign(f[0]);
+            r.startOffset = strtoull(string(f[1]).c_str(), nullptr, 10);
+            r.done = f[3] == "done";
+            runs.push_back(r);
+        }
+    }
+    bool save() const {
+        string data;
+        for (auto& r : runs) data += r.period + "," + to_string(r.startOffset) + "," + to_string(r.invoices) + "," + (r.done ? "done" : "running") + "\n";
+        return write_file_atomic(BILLING_RUNS_FILE, data);
+    }
+    Run& start(const string& period, uint64_t ledgerSize) {
+        for (auto& r : runs) {
+            if (r.period == period) return r;
+        }
+        runs.push_back(Run{ period, ledgerSize, 0, false });
+        return runs.back();
+    }
+};
+
+// Bills every subscription due in a period, one invoice per customer with a
+// line per due subscription, priced from a single catalog version. Invoices
+// are built and rendered on a work-stealing pool in batches; each batch
+// takes a block of ids, is stored with one append per file and is durable
+// before the checkpoint records it.
+int run_billing(const CommandOptions& opt) {
+    string periodText = opt.get("period", now_date().substr(0, 7));
+    int period = parse_period(periodText);
+    if (period < 0) {
+        cerr << "Invalid --period " << periodText << ", use YYYY-MM\n";
+        return 2;
+    }
+    string path = opt.get("subscriptions", SUBSCRIPTIONS_FILE);
+    size_t threads = (size_t)max<long long>(1, opt.get_int("threads", thread::hardware_concurrency()));
+    size_t batch = (size_t)max<long long>(1, opt.get_int("batch", 1024));
+    auto t0 = chrono::steady_clock::now();
+    vector<Subscription> subs;
+    vector<CsvReject> rejects;
+    if (!import_csv_file(path, opt.get_int("header", 0) != 0, threads, Subscription::parse, subs, rejects)) return 1;
+    for (auto& r : rejects) cerr << path << ":" << r.line << ": " << r.reason << "\n";
+
+    BillingSystem bs;
+    configure_storage(bs, opt);
+    BillingRunLog log;
+    log.load();
+    BillingRunLog::Run& run = log.start(periodText, max<uint64_t>(bs.ledger.ledgerSize, 2 * sizeof(uint32_t)));
+    if (!log.save()) {
+        cerr << "Could not write " << BILLING_RUNS_FILE << "\n";
+        return 1;
+    }
+    string note = "Subscriptions " + periodText;
+    unordered_set<int> billed = bs.ledger.customers_with_note(note, run.startOffset);
+    CatalogPin cat = bs.catalog.pin();
+    map<int, InvoiceLines> due;
+    size_t skipped = 0;
+    for (auto& sub : subs) {
+        if (!sub.due(period) || billed.count(sub.customerId)) continue;
+        ItemRow it = cat->resolve(sub.item);
+        InvoiceLine L;
+        if (it) L = BillingSystem::invoice_line(it, sub.quantity);
+        const char* problem = !bs.find_customer(sub.customerId) ? "unknown customer" : !it ? "unknown item" : nullptr;
+        // The bound covers the whole merged invoice, not just this line.
+        InvoiceLines* lines = problem ? nullptr : &due[sub.customerId];
+        if (lines && !lines->fits(L)) problem = "amount too large";
+        if (problem) {
+            if (skipped++ < 20) cerr << "Skipped subscription of customer " << sub.customerId << " to " << sub.item << ": " << problem << "\n";
+            if (lines && lines->empty()) due.erase(sub.customerId);
+            continue;
+        }
+        lines->push_back(L);
+    }
+    if (skipped > 20) cerr << "... " << skipped - 20 << " more subscriptions skipped\n";
+    vector<pair<int, InvoiceLines>> plan(make_move_iterator(due.begin()), make_move_iterator(due.end()));
+    due.clear();
+
+    int firstId = 0, lastId = 0;
+    vector<TextBuffer> buffers(threads);
+    for (size_t done = 0; done < plan.size();) {
+        size_t n = min(batch, plan.size() - done);
+        vector<Invoice> invs(n);
+        vector<string> docs(n);
+        int blockStart = bs.ids.allocate(ID_INVOICE, (int)n);
+        if (!blockStart) {
+            cerr << "Could not reserve invoice ids; rerun --bill-run --period " << periodText << " to resume.\n";
+            return 1;
+        }
+        if (!firstId) firstId = blockStart;
+        lastId = blockStart + (int)n - 1;
+        string date = now_date(), generated = now_datetime();
+        int dateKey = date_key(date);
+        work_stealing_for(n, threads, 16, [&](size_t w, size_t i) {
+            Invoice& inv = invs[i];
+            inv.id = blockStart + (int)i;
+            inv.customerId = plan[done + i].first;
+            inv.date = date;
+            inv.note = note;
+            inv.lines = move(plan[done + i].second);
+            inv.discountBp = 0;
+            inv.shipping = Money();
+            inv.catalogVersion = cat->version;
+            CustomerRow c = bs.find_customer(inv.customerId);
+            bs.taxes.apply(inv.lines, *cat, c.address, dateKey);
+            TextBuffer& out = buffers[w];
+            out.clear();
+            inv.render_txt(c, out, generated.c_str());
+            docs[i] = out.buf;
+        });
+        if (!bs.writer.wait(bs.store_invoices(invs, docs))) {
+            cerr << "Write failed; rerun --bill-run --period " << periodText << " to resume.\n";
+            return 1;
+        }
+        done += n;
+        run.invoices += (int)n;
+        log.save();
+    }
+    run.done = true;
+    log.save();
+    bs.shutdown();
+    auto ms = (long long)chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - t0).count();
+    cout << "Billed " << plan.size() << " invoices for " << periodText;
+    if (!plan.empty()) cout << " (ids " << firstId << "-" << lastId << ")";
+    cout << "; " << billed.size() << " customers already billed, " << skipped << " subscriptions skipped, " << rejects.size()
+         << " rows rejected. " << ms << " ms.\n";
+    return 0;
+}
+
+struct NullBuffer : streambuf {
+    int overflow(int c) override { return c; }
+    streamsize xsputn(const char*, streamsize n) override { return n; }
+};
+
+struct LatencySeries {
+    string op;
+    vector<uint64_t> ns;
+    explicit LatencySeries(const string& name) : op(name) {}
+    template <class F>
+    void time(F f) {
+        auto t0 = chrono::steady_clock::now();
+        f();
+        ns.push_back((uint64_t)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - t0).count());
+    }
+    string json() {
+        sort(ns.begin(), ns.end());
+        auto pct = [&](int p) { return ns.empty() ? 0 : ns[(ns.size() - 1) * p / 100]; };
+        uint64_t sum = 0;
+        for (auto v : ns) sum += v;
+        stringstream ss;
+        ss << "{\"op\":\"" << op << "\",\"iterations\":" << ns.size() << ",\"mean_ns\":" << (ns.empty() ? 0 : sum / ns.size())
+           << ",\"p50_ns\":" << pct(50) << ",\"p90_ns\":" << pct(90) << ",\"p99_ns\":" << pct(99)
+           << ",\"max_ns\":" << (ns.empty() ? 0 : ns.back()) << "}";
+        return ss.str();
+    }
+};
+
+// Benchmarks run against the data files in the current directory. save_invoice
+// appends real invoices, so point it at a generated dataset.
+int run_bench(const CommandOptions& opt) {
+    long long lookups = opt.get_int("lookups", 100000);
+    long long queries = opt.get_int("queries", 200);
+    long long renders = opt.get_int("renders", 2000);
+    long long saves = opt.get_int("saves", 200);
+    long long loads = opt.get_int("loads", 3);
+    long long reports = opt.get_int("reports", 5);
+    long long reads = opt.get_int("reads", 2000);
+    uint64_t seed = (uint64_t)opt.get_int("seed", 7);
+    string outPath = opt.get("out", "");
+    NullBuffer nullBuf;
+    ostream nullOut(&nullBuf);
+    streambuf* saved = cout.rdbuf(&nullBuf);
+    vector<LatencySeries> results;
+    unique_ptr<BillingSystem> sys;
+
+    results.push_back(LatencySeries("constructor_csv"));
+    for (long long i = 0; i < loads; ++i) {
+        remove(SNAPSHOT_FILE.c_str());
+        sys.reset();
+        results.back().time([&] { sys.reset(new BillingSystem()); });
+    }
+    results.push_back(LatencySeries("constructor_snapshot"));
+    for (long long i = 0; i < loads; ++i) {
+        sys->save_snapshot();
+        sys.reset();
+        results.back().time([&] { sys.reset(new BillingSystem()); });
+    }
+    if (!sys) sys.reset(new BillingSystem());
+    BillingSystem& bs = *sys;
+    size_t customerBytes = bs.customer_memory(), itemBytes = bs.item_memory(), residentBytes = resident_bytes();
+    configure_storage(bs, opt);
+    const ItemTable& items = bs.catalog.latest().items;
+    if (bs.customers.empty() || items.empty()) {
+        cout.rdbuf(saved);
+        cerr << "Benchmark needs customers and items; run --generate first.\n";
+        return 1;
+    }
+    Rng r(seed);
+    size_t found = 0;
+    results.push_back(LatencySeries("find_customer"));
+    for (long long i = 0; i < lookups; ++i) {
+        int id = r.below(10) == 0 ? -1 - (int)i : bs.customers[r.below(bs.customers.size())].id;
+        results.back().time([&] { found += bs.find_customer(id).found; });
+    }
+    results.push_back(LatencySeries("find_item_by_id"));
+    for (long long i = 0; i < lookups; ++i) {
+        int id = items[r.below(items.size())].id;
+        results.back().time([&] { found += bs.find_item_by_id(bs.catalog.pin(), id).found; });
+    }
+    results.push_back(LatencySeries("catalog_pin"));
+    for (long long i = 0; i < lookups; ++i) {
+        results.back().time([&] { found += bs.catalog.pin()->version != 0; });
+    }
+    results.push_back(LatencySeries("find_item_by_code"));
+    for (long long i = 0; i < lookups; ++i) {
+        string code(items[r.below(items.size())].code);
+        results.back().time([&] { found += bs.find_item_by_code(bs.catalog.pin(), code).found; });
+    }
+    auto fragment = [&](string_view s) {
+        size_t len = min<size_t>(s.size(), 3 + r.below(4));
+        return string(s.substr(r.below(s.size() - len + 1), len));
+    };
+    results.push_back(LatencySeries("search_customers"));
+    for (long long i = 0; i < queries; ++i) {
+        string q = fragment(bs.customers[r.below(bs.customers.size())].name);
+        size_t total = 0;
+        results.back().time([&] { found += bs.query_customers(q, total).size(); });
+    }
+    results.push_back(LatencySeries("search_items"));
+    for (long long i = 0; i < queries; ++i) {
+        string q = fragment(items[r.below(items.size())].description);
+        size_t total = 0;
+        results.back().time([&] { found += bs.query_items(q, total).size(); });
+    }
+    vector<Invoice> sample;
+    for (long long i = 0; i < max(renders, saves); ++i) {
+        Invoice inv;
+        inv.id = 0;
+        inv.customerId = bs.customers[r.below(bs.customers.size())].id;
+        inv.date = now_date();
+        size_t nLines = 1 + r.below(12);
+        for (size_t k = 0; k < nLines; ++k) {
+            ItemRow it = items[r.below(items.size())];
+            InvoiceLine L = { it.id, string(it.description), it.unitPrice, (int64_t)(1 + r.below(20)) * QTY_SCALE, it.taxBp };
+            inv.lines.push_back(L);
+        }
+        inv.discountBp = 0;
+        inv.shipping = Money::cents(499);
+        inv.note = "benchmark";
+        sample.push_back(inv);
+    }
+    // Without a rules file, time a synthetic set: VAT by city with a rate
+    // change, reduced rates for two SKU ranges in half the cities and a
+    // compound surtax in two.
+    TaxEngine synthetic;
+    const TaxEngine* taxes = &bs.taxes;
+    if (taxes->empty()) {
+        string rules = "category,food,SKU-00000\ncategory,books,SKU-00001\n";
+        for (size_t i = 0; i < sizeof(GEN_CITY) / sizeof(GEN_CITY[0]); ++i) {
+            string city = GEN_CITY[i];
+            rules += "region," + city + "," + city + "\n";
+            rules += "rate,*," + city + ",VAT,2000-01-01," + to_string(5 + i) + "\n";
+            rules += "rate,*," + city + ",VAT,2024-01-01," + to_string(6 + i) + ".5\n";
+            if (i % 2 == 0) rules += "rate,food," + city + ",VAT,2000-01-01,2.5\nrate,books," + city + ",VAT,2000-01-01,0\n";
+            if (i % 4 == 0) rules += "rate,*," + city + ",Surtax,2000-01-01,1.25,compound\n";
+        }
+        vector<CsvReject> rejects;
+        synthetic.compile(rules.data(), rules.data() + rules.size(), rejects);
+        taxes = &synthetic;
+    }
+    const CatalogSnapshot* snapshot = &bs.catalog.latest();
+    CatalogSnapshot recategorized;
+    if (taxes == &synthetic) {
+        recategorized = *snapshot;
+        recategorized.taxCategory.clear();
+        synthetic.categorize(recategorized);
+        snapshot = &recategorized;
+    }
+    results.push_back(LatencySeries("tax_apply"));
+    LatencySeries perLine("tax_apply_per_line");
+    for (long long i = 0; i < renders; ++i) {
+        Invoice inv = sample[i];
+        CustomerRow c = bs.find_customer(inv.customerId);
+        int dateKey = date_key(inv.date);
+        results.back().time([&] { taxes->apply(inv.lines, *snapshot, c.address, dateKey); });
+        perLine.ns.push_back(results.back().ns.back() / inv.lines.size());
+        found += inv.lines.taxBp[0];
+    }
+    results.push_back(perLine);
+    results.push_back(LatencySeries("to_txt"));
+    for (long long i = 0; i < renders; ++i) {
+        const Invoice& inv = sample[i];
+        CustomerRow c = bs.find_customer(inv.customerId);
+        results.back().time([&] { found += inv.to_txt(c).size(); });
+    }
+    results.push_back(LatencySeries("render_bulk"));
+    InvoiceRenderer renderer;
+    for (long long i = 0; i < renders; ++i) {
+        const Invoice& inv = sample[i];
+        CustomerRow c = bs.find_customer(inv.customerId);
+        results.back().time([&] { found += renderer.render(inv, c).size(); });
+    }
+    results.push_back(LatencySeries("save_invoice"));
+    for (long long i = 0; i < saves; ++i) {
+        Invoice& inv = sample[i];
+        inv.id = bs.ids.allocate(ID_INVOICE);
+        if (!inv.id) break;
+        CustomerRow c = bs.find_customer(inv.customerId);
+        results.back().time([&] { bs.save_invoice(inv, c); });
+    }
+    results.push_back(LatencySeries("read_document"));
+    string doc;
+    for (long long i = 0; i < reads && !bs.ledger.index.empty(); ++i) {
+        int id = bs.ledger.index[r.below(bs.ledger.index.size())].id;
+        results.back().time([&] { found += bs.read_document(id, doc); });
+    }
+    int firstKey = bs.ledger.index.empty() ? 0 : bs.ledger.index.front().date;
+    int lastKey = bs.ledger.index.empty() ? 0 : bs.ledger.index.back().date;
+    results.push_back(LatencySeries("export_report_sales_all"));
+    for (long long i = 0; i < reports; ++i) results.back().time([&] { bs.sales_report(firstKey, lastKey, nullOut); });
+    results.push_back(LatencySeries("export_report_sales_month"));
+    for (long long i = 0; i < reports; ++i) {
+        int key = bs.ledger.index.empty() ? 0 : bs.ledger.index[r.below(bs.ledger.index.size())].date;
+        results.back().time([&] { bs.sales_report(key / 100 * 100 + 1, key / 100 * 100 + 31, nullOut); });
+    }
+    results.push_back(LatencySeries("customer_statement"));
+    for (long long i = 0; i < lookups / 100; ++i) {
+        int id = bs.customers[r.below(bs.customers.size())].id;
+        results.back().time([&] { bs.customer_statement(id, nullOut); });
+    }
+    const SalesGroup analyticsGroups[] = { GROUP_MONTH, GROUP_CUSTOMER, GROUP_ITEM };
+    for (SalesGroup g : analyticsGroups) {
+        results.push_back(LatencySeries(string("sales_analytics_") + SALES_GROUP_NAMES[g]));
+        for (long long i = 0; i < reports; ++i) results.back().time([&] { bs.sales_analytics(firstKey, lastKey, g, nullOut); });
+    }
+    cout.rdbuf(saved);
+
+    stringstream js;
+    js << "{\"benchmark\":\"billing-system\",\"dataset\":{\"customers\":" << bs.customers.size() << ",\"items\":" << items.size()
+       << ",\"invoices\":" << bs.ledger.index.size() << "},\"memory\":{\"customer_bytes\":" << customerBytes
+       << ",\"bytes_per_customer\":" << customerBytes / max<size_t>(1, bs.customers.size()) << ",\"item_bytes\":" << itemBytes
+       << ",\"bytes_per_item\":" << itemBytes / max<size_t>(1, items.size()) << ",\"resident_bytes\":" << residentBytes
+       << "},\"results\":[\n";
+    for (size_t i = 0; i < results.size(); ++i) js << "  " << results[i].json() << (i + 1 < results.size() ? ",\n" : "\n");
+    js << "],\"checksum\":" << found << "}\n";
+    if (outPath.empty()) cout << js.str();
+    else {
+        ofstream out(outPath.c_str());
+        out << js.str();
+        cout << "Benchmark results written to " << outPath << "\n";
+    }
+    return 0;
+}
+
+#ifndef _WIN32
+// Daemon mode: one BillingSystem shared by a worker pool over a Unix domain
+// socket. A request is one tab-separated line; the reply is
+// "OK <bytes>\n<payload>" or "ERR <message>\n". Readers hold the rwlock
+// shared. Writers serialize on writeLock, validate and render outside the
+// rwlock and take it exclusively only to publish the new record, so
+// lookups wait at most for one in-memory insert. Item lookups and invoice
+// pricing pin a catalog snapshot instead of taking the rwlock. Replies to
+// writes are sent once the group commit has made them durable.
+static volatile sig_atomic_t g_stopDaemon = 0;
+
+static void on_stop_signal(int) { g_stopDaemon = 1; }
+
+struct RwLock {
+    pthread_rwlock_t lock;
+    RwLock() { pthread_rwlock_init(&lock, nullptr); }
+    ~RwLock() { pthread_rwlock_destroy(&lock); }
+    RwLock(const RwLock&) = delete;
+    RwLock& operator=(const RwLock&) = delete;
+};
+
+struct ReadGuard {
+    pthread_rwlock_t* lock;
+    explicit ReadGuard(RwLock& l) : lock(&l.lock) { pthread_rwlock_rdlock(lock); }
+    ~ReadGuard() { pthread_rwlock_unlock(lock); }
+};
+
+struct WriteGuard {
+    pthread_rwlock_t* lock;
+    explicit WriteGuard(RwLock& l) : lock(&l.lock) { pthread_rwlock_wrlock(lock); }
+    ~WriteGuard() { pthread_rwlock_unlock(lock); }
+};
+
+// A non-blocking fd that stays full for timeoutMs fails the write.
+bool write_all(int fd, const char* p, size_t n, int timeoutMs = 5000) {
+    while (n > 0) {
+        ssize_t w = ::write(fd, p, n);
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            pollfd pf = { fd, POLLOUT, 0 };
+            if (poll(&pf, 1, timeoutMs) > 0) continue;
+            return false;
+        }
+        if (w <= 0) return false;
+        p += w;
+        n -= (size_t)w;
+    }
+    return true;
+}
+
+// Reads up to the next '\n' into line, keeping any bytes after it in buf.
+bool read_line(int fd, string& buf, string& line) {
+    for (;;) {
+        size_t nl = buf.find('\n');
+        if (nl != string::npos) {
+            line.assign(buf, 0, nl);
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            buf.erase(0, nl + 1);
+            return true;
+        }
+        if (buf.size() > (1 << 20)) return false;
+        char tmp[4096];
+        ssize_t r = ::read(fd, tmp, sizeof(tmp));
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return false;
+        buf.append(tmp, (size_t)r);
+    }
+}
+
+int connect_unix(const string& path) {
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) return -1;
+    memcpy(addr.sun_path, path.c_str(), path.size());
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0) { ::close(fd); return -1; }
+    return fd;
+}
+
+struct BillingDaemon {
+    BillingSystem& bs;
+    RwLock rw;
+    mutex writeLock;
+    mutex queueLock;
+    condition_variable queueReady;
+    // A connection and the complete request lines read from it.
+    deque<pair<int, string>> queue;
+    bool stopping = false;
+    int wakeFds[2];
+
+    explicit BillingDaemon(BillingSystem& sys) : bs(sys) { wakeFds[0] = wakeFds[1] = -1; }
+
+    static string ok(const string& payload) { return "OK " + to_string(payload.size()) + "\n" + payload; }
+    static string err(const string& message) { return "ERR " + message + "\n"; }
+
+    string handle(string_view line) {
+        string_view f[256];
+        size_t n = split_fields(line, f, 256, '\t');
+        string_view cmd = f[0];
+        int id;
+        if (cmd == "PING") return ok("pong");
+        if (cmd == "INFO") {
+            ReadGuard g(rw);
+            return ok("customers " + to_string(bs.customers.size()) + "\nitems " + to_string(bs.catalog.latest().items.size()) +
+                      "\ninvoices " + to_string(bs.ledger.index.size()) + "\ncustomer_bytes " + to_string(bs.customer_memory()) +
+                      "\nitem_bytes " + to_string(bs.item_memory()) + "\n");
+        }
+        if (cmd == "CUSTOMER" && n == 2 && parse_int(f[1], id)) {
+            ReadGuard g(rw);
+            CustomerRow c = bs.find_customer(id);
+            return c ? ok(c.to_csv() + "\n") : err("customer not found");
+        }
+        if (cmd == "ITEM" && n == 2) {
+            CatalogPin cat = bs.catalog.pin();
+            ItemRow it = cat->resolve(string(f[1]));
+            return it ? ok(it.to_csv() + "\n") : err("item not found");
+        }
+        if ((cmd == "SEARCH_CUSTOMERS" || cmd == "SEARCH_ITEMS") && n == 2) {
+            ReadGuard g(rw);
+            size_t total = 0;
+            string out;
+            if (cmd == "SEARCH_CUSTOMERS") {
+                for (int r : bs.query_customers(string(f[1]), total)) out += bs.find_customer(r).to_csv() + "\n";
+            } else {
+                CatalogPin cat = bs.catalog.pin();
+                for (int r : bs.query_items(string(f[1]), total)) out += bs.find_item_by_id(cat, r).to_csv() + "\n";
+            }
+            return ok("matches " + to_string(total) + "\n" + out);
+        }
+        // LIST_CUSTOMERS|LIST_ITEMS limit [after-key after-id]
+        // LIST_INVOICES limit customer-or-0 [after-date-or-offset after-id]
+        // The first payload line is "next" and the cursor to pass back for
+        // the following page, or "end".
+        int limit;
+        if ((cmd == "LIST_CUSTOMERS" || cmd == "LIST_ITEMS" || cmd == "LIST_INVOICES") && n >= 2 && parse_int(f[1], limit) && limit > 0) {
+            size_t first = cmd == "LIST_INVOICES" ? 3 : 2;
+            int customerId = 0;
+            ListCursor cur;
+            if (first == 3 && (n < 3 || !parse_int(f[2], customerId))) return err("expected LIST_INVOICES limit customer [after-key after-id]");
+            if (n == first + 2) {
+                cur.started = true;
+                cur.text.assign(f[first]);
+                if (!parse_int(f[first + 1], cur.id) || (first == 3 && !parse_decimal(f[first], 1, cur.number))) return err("invalid cursor");
+            } else if (n != first) return err("cursor needs a key and an id");
+            string rows;
+            size_t pageSize = min<size_t>(limit, 1000);
+            ReadGuard g(rw);
+            if (cmd == "LIST_CUSTOMERS") {
+                for (auto& c : bs.customer_page(cur, pageSize)) rows += c.to_csv() + "\n";
+            } else if (cmd == "LIST_ITEMS") {
+                CatalogPin cat = bs.catalog.pin();
+                for (auto& it : bs.item_page(cat, cur, pageSize)) rows += it.to_csv() + "\n";
+            } else {
+                for (auto& h : bs.invoice_page(customerId, cur, pageSize)) {
+                    rows += to_string(h.id) + "," + to_string(h.customerId) + "," + date_from_key(h.date) + "," + format_hundredths(h.discountBp) + ","
+                          + format_hundredths(h.shipping) + "," + to_string(h.catalogVersion) + "\n";
+                }
+            }
+            string next = !cur.more ? "end" : "next\t" + (first == 3 ? to_string(cur.number) : cur.text) + "\t" + to_string(cur.id);
+            return ok(next + "\n" + rows);
+        }
+        if (cmd == "INVOICE" && n == 2 && parse_int(f[1], id)) {
+            ReadGuard g(rw);
+            string doc;
+            return bs.read_document(id, doc) ? ok(doc) : err("invoice not found");
+        }
+        if (cmd == "SALES_REPORT" && n == 3) {
+            int startKey = date_key(string(f[1])), endKey = date_key(string(f[2]));
+            if (startKey < 0 || endKey < 0) return err("invalid date, use YYYY-MM-DD");
+            ReadGuard g(rw);
+            ostringstream out;
+            bs.sales_report(startKey, endKey, out);
+            return ok(out.str());
+        }
+        if (cmd == "STATEMENT" && n == 2 && parse_int(f[1], id)) {
+            ReadGuard g(rw);
+            ostringstream out;
+            return bs.customer_statement(id, out) ? ok(out.str()) : err("customer not found");
+        }
+        if (cmd == "ANALYTICS" && n == 4) {
+            int startKey = date_key(string(f[1])), endKey = date_key(string(f[2]));
+            if (startKey < 0 || endKey < 0) return err("invalid date, use YYYY-MM-DD");
+            for (int grp = GROUP_CUSTOMER; grp <= GROUP_TAX_RATE; ++grp) {
+                if (f[3] != SALES_GROUP_NAMES[grp]) continue;
+                ReadGuard g(rw);
+                ostringstream out;
+                bs.sales_analytics(startKey, endKey, (SalesGroup)grp, out);
+                return ok(out.str());
+            }
+            return err("group by customer, day, month, item or tax");
+        }
+        if (cmd == "STATS") {
+#ifndef BILLING_NO_STATS
+            ostringstream out;
+            g_stats.dump(out);
+            return ok(out.str());
+#else
+            return err("statistics are disabled in this build");
+#endif
+        }
+        if (cmd == "ADD_CUSTOMER" && n == 5) {
+            Customer c;
+            c.name = string(f[1]);
+            c.address = string(f[2]);
+            c.email = string(f[3]);
+            c.phone = string(f[4]);
+            uint64_t ticket;
+            {
+                lock_guard<mutex> w(writeLock);
+                WriteGuard g(rw);
+                ticket = bs.insert_customer(c);
+            }
+            if (!ticket) return err("could not reserve an id");
+            return bs.writer.wait(ticket) ? ok(to_string(c.id)) : err("write failed");
+        }
+        if (cmd == "ADD_ITEM" && n == 5) {
+            Item it;
+            it.code = string(f[1]);
+            it.description = string(f[2]);
+            int64_t bp;
+            if (!parse_decimal(f[3], 100, it.unitPrice.minor) || !parse_decimal(f[4], 100, bp)) return err("invalid price or tax");
+            it.taxBp = (int32_t)bp;
+            uint64_t ticket;
+            {
+                lock_guard<mutex> w(writeLock);
+                if (bs.find_item_by_code(bs.catalog.pin(), it.code)) return err("an item with SKU " + it.code + " already exists");
+                WriteGuard g(rw);
+                ticket = bs.insert_item(it);
+            }
+            if (!ticket) return err("could not reserve an id");
+            return bs.writer.wait(ticket) ? ok(to_string(it.id)) : err("write failed");
+        }
+        // CREATE_INVOICE <customer> <discount %> <shipping> <note> <sku or id>=<qty>...
+        if (cmd == "CREATE_INVOICE" && n >= 5 && parse_int(f[1], id)) {
+            Invoice inv;
+            int64_t bp;
+            inv.customerId = id;
+            inv.note = string(f[4]);
+            if (!parse_decimal(f[2], 100, bp) || !parse_decimal(f[3], 100, inv.shipping.minor)) return err("invalid discount or shipping");
+            inv.discountBp = (int32_t)bp;
+            STATS_TIMER(OP_SAVE_INVOICE);
+            // Lines are priced from one pinned catalog version without
+            // holding any lock.
+            CatalogPin cat = bs.catalog.pin();
+            {
+                inv.catalogVersion = cat->version;
+                for (size_t i = 5; i < n; ++i) {
+                    size_t eq = f[i].rfind('=');
+                    int64_t qty;
+                    if (eq == string_view::npos || !parse_decimal(f[i].substr(eq + 1), QTY_SCALE, qty)) return err("line " + to_string(i - 4) + ": expected SKU=QTY");
+                    ItemRow it = cat->resolve(string(f[i].substr(0, eq)));
+                    if (!it) return err("line " + to_string(i - 4) + ": item not found");
+                    InvoiceLine L = BillingSystem::invoice_line(it, qty);
+                    if (!inv.lines.fits(L)) return err("line " + to_string(i - 4) + ": amount too large");
+                    inv.lines.push_back(L);
+                }
+            }
+            uint64_t ticket;
+            {
+                lock_guard<mutex> w(writeLock);
+                CustomerRow c = bs.find_customer(id);
+                if (!c) return err("customer not found");
+                inv.date = now_date();
+                inv.id = bs.ids.allocate(ID_INVOICE);
+                if (!inv.id) return err("could not reserve an id");
+                bs.taxes.apply(inv.lines, *cat, c.address, date_key(inv.date));
+                const string* doc;
+                {
+                    STATS_TIMER(OP_RENDER_INVOICE);
+                    doc = &bs.renderer.render(inv, c);
+                }
+                WriteGuard g(rw);
+                ticket = bs.store_invoice(inv, *doc);
+            }
+            // Wait outside both locks so concurrent writers share a commit.
+            return bs.writer.wait(ticket) ? ok(to_string(inv.id)) : err("write failed");
+        }
+        return err("unknown or malformed request");
+    }
+    // Answers each line of requests in order; returns false if the client
+    // stopped reading.
+    bool serve(int fd, const string& requests) {
+        for (size_t at = 0; at < requests.size();) {
+            size_t nl = requests.find('\n', at);
+            string_view line(requests.data() + at, nl - at);
+            if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+            at = nl + 1;
+            string reply = handle(line);
+            if (!write_all(fd, reply.data(), reply.size())) return false;
+        }
+        return true;
+    }
+    // Workers never close a connection: they hand it back, as ~fd when it
+    // is to be dropped, so its number cannot be reused while the accept
+    // thread still holds its buffer.
+    void worker() {
+        for (;;) {
+            pair<int, string> job;
+            {
+                unique_lock<mutex> g(queueLock);
+                queueReady.wait(g, [&] { return stopping || !queue.empty(); });
+                if (queue.empty()) return;
+                job = move(queue.front());
+                queue.pop_front();
+            }
+            int back = serve(job.first, job.second) ? job.first : ~job.first;
+            write_all(wakeFds[1], (const char*)&back, sizeof(back));
+        }
+    }
+    // Reads what is available on a non-blocking connection; returns false
+    // when the client has gone away or sent an overlong line.
+    static bool fill(int fd, string& buf) {
+        char tmp[4096];
+        for (;;) {
+            ssize_t r = ::read(fd, tmp, sizeof(tmp));
+            if (r < 0 && errno == EINTR) continue;
+            if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            if (r <= 0) return false;
+            buf.append(tmp, (size_t)r);
+        }
+        size_t nl = buf.rfind('\n');
+        return buf.size() - (nl == string::npos ? 0 : nl + 1) <= (1 << 20);
+    }
+    // The accept thread owns every connection and its input buffer. It polls
+    // the idle ones, reads whatever arrives and hands a connection to the
+    // pool only once it holds complete request lines, so a slow or stalled
+    // client never ties up a worker. The worker gives the connection back
+    // over a pipe when it has answered them.
+    int run(const string& path, int workers) {
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path)) { cerr << "Socket path too long: " << path << "\n"; return 1; }
+        memcpy(addr.sun_path, path.c_str(), path.size());
+        int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        unlink(path.c_str());
+        if (listener < 0 || ::bind(listener, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(listener, 128) != 0) {
+            cerr << "Could not listen on " << path << ": " << strerror(errno) << "\n";
+            return 1;
+        }
+        if (pipe(wakeFds) != 0) { cerr << "pipe: " << strerror(errno) << "\n"; return 1; }
+        signal(SIGPIPE, SIG_IGN);
+        signal(SIGINT, on_stop_signal);
+        signal(SIGTERM, on_stop_signal);
+        vector<thread> pool;
+        for (int i = 0; i < workers; ++i) pool.emplace_back([this] { worker(); });
+        cout << "Serving on " << path << " with " << workers << " workers. Send SIGINT or SIGTERM to stop.\n" << flush;
+        unordered_map<int, string> conns;
+        vector<int> idle;
+        vector<pollfd> fds;
+        auto drop = [&](int fd) {
+            conns.erase(fd);
+            ::close(fd);
+        };
+        while (!g_stopDaemon) {
+            fds.clear();
+            fds.push_back(pollfd{ listener, POLLIN, 0 });
+            fds.push_back(pollfd{ wakeFds[0], POLLIN, 0 });
+            for (int fd : idle) fds.push_back(pollfd{ fd, POLLIN, 0 });
+            if (poll(fds.data(), fds.size(), 200) <= 0) continue;
+            vector<int> still;
+            for (size_t i = 2; i < fds.size(); ++i) {
+                int fd = fds[i].fd;
+                if (!fds[i].revents) { still.push_back(fd); continue; }
+                string& buf = conns[fd];
+                if (!fill(fd, buf)) { drop(fd); continue; }
+                size_t nl = buf.rfind('\n');
+                if (nl == string::npos) { still.push_back(fd); continue; }
+                lock_guard<mutex> g(queueLock);
+                queue.emplace_back(fd, buf.substr(0, nl + 1));
+                buf.erase(0, nl + 1);
+                queueReady.notify_one();
+            }
+            idle.swap(still);
+            if (fds[1].revents & POLLIN) {
+                int back[64];
+                ssize_t r = ::read(wakeFds[0], back, sizeof(back));
+                for (ssize_t i = 0; i < r / (ssize_t)sizeof(int); ++i) {
+                    if (back[i] < 0) drop(~back[i]);
+                    else idle.push_back(back[i]);
+                }
+            }
+            if (fds[0].revents & POLLIN) {
+                int fd = accept(listener, nullptr, nullptr);
+                if (fd >= 0 && fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == 0) {
+                    conns[fd];
+                    idle.push_back(fd);
+                } else if (fd >= 0) {
+                    ::close(fd);
+                }
+            }
+        }
+        {
+            lock_guard<mutex> g(queueLock);
+            stopping = true;
+            queueReady.notify_all();
+        }
+        for (auto& t : pool) t.join();
+        for (auto& c : conns) ::close(c.first);
+        ::close(listener);
+        ::close(wakeFds[0]);
+        ::close(wakeFds[1]);
+        unlink(path.c_str());
+        bs.shutdown();
+        cout << "Daemon stopped.\n";
+        return 0;
+    }
+};
+
+int run_serve(const CommandOptions& opt) {
+    string path = opt.get("socket", "billing.sock");
+    int workers = (int)opt.get_int("workers", max(2u, thread::hardware_concurrency()));
+    if (workers < 1) workers = 1;
+    BillingSystem sys;
+    configure_storage(sys, opt);
+    BillingDaemon daemon(sys);
+    return daemon.run(path, workers);
+}
+
+// Load generator for --serve: each client thread keeps one connection and
+// issues a weighted mix of lookups, searches, reports and invoice writes.
+int run_load(const CommandOptions& opt) {
+    string path = opt.get("socket", "billing.sock");
+    int clients = (int)opt.get_int("clients", 8);
+    long long requests = opt.get_int("requests", 10000);
+    int writePct = (int)opt.get_int("write-percent", 5);
+    int searchPct = (int)opt.get_int("search-percent", 10);
+    int reportPct = (int)opt.get_int("report-percent", 1);
+    uint64_t seed = (uint64_t)opt.get_int("seed", 11);
+    string outPath = opt.get("out", "");
+    int probe = connect_unix(path);
+    if (probe < 0) { cerr << "Could not connect to " << path << "\n"; return 1; }
+    string probeBuf;
+    auto call = [](int fd, string& buf, const string& req, string& payload) {
+        string head;
+        if (!write_all(fd, req.data(), req.size()) || !read_line(fd, buf, head)) return false;
+        if (head.compare(0, 3, "OK ") != 0) { payload = head; return true; }
+        size_t len = (size_t)atoll(head.c_str() + 3);
+        while (buf.size() < len) {
+            char tmp[65536];
+            ssize_t r = ::read(fd, tmp, sizeof(tmp));
+            if (r <= 0) return false;
+            buf.append(tmp, (size_t)r);
+        }
+        payload.assign(buf, 0, len);
+        buf.erase(0, len);
+        return true;
+    };
+    string info;
+    if (!call(probe, probeBuf, "INFO\n", info)) { cerr << "INFO request failed\n"; return 1; }
+    ::close(probe);
+    long long nCustomers = 0, nItems = 0;
+    sscanf(info.c_str(), "customers %lld\nitems %lld", &nCustomers, &nItems);
+    if (nCustomers <= 0 || nItems <= 0) { cerr << "Daemon needs customers and items; run --generate first.\n"; return 1; }
+    const char* ops[] = { "lookup", "search", "report", "create_invoice" };
+    vector<vector<LatencySeries>> series(clients);
+    atomic<long long> errors(0);
+    vector<thread> threads;
+    auto t0 = chrono::steady_clock::now();
+    for (int c = 0; c < clients; ++c) {
+        for (auto op : ops) series[c].push_back(LatencySeries(op));
+        threads.emplace_back([&, c] {
+            int fd = connect_unix(path);
+            if (fd < 0) { errors += requests; return; }
+            Rng r(seed * 1000003 + c);
+            string cbuf, payload;
+            for (long long i = 0; i < requests; ++i) {
+                int roll = (int)r.below(100);
+                int kind = roll < writePct ? 3 : roll < writePct + reportPct ? 2 : roll < writePct + reportPct + searchPct ? 1 : 0;
+                string req;
+                if (kind == 0) req = (r.below(2) ? "CUSTOMER\t" + to_string(1001 + r.below(nCustomers)) : "ITEM\t" + to_string(5001 + r.below(nItems))) + "\n";
+                else if (kind == 1) req = r.below(2) ? string("SEARCH_CUSTOMERS\t") + r.pick(GEN_FIRST) + "\n" : string("SEARCH_ITEMS\t") + r.pick(GEN_ADJ) + "\n";
+                else if (kind == 2) req = "SALES_REPORT\t" + date_from_key(date_key_from_days(days_from_civil(2020, 1, 1) + (int64_t)r.below(5 * 365))) + "\t" + date_from_key(date_key_from_days(days_from_civil(2020, 1, 1) + 5 * 365)) + "\n";
+                else {
+                    req = "CREATE_INVOICE\t" + to_string(1001 + r.below(nCustomers)) + "\t0\t4.99\tload test";
+                    for (size_t k = 0, lines = 1 + r.below(6); k < lines; ++k) req += "\t" + to_string(5001 + r.below(nItems)) + "=" + to_string(1 + r.below(5));
+                    req += "\n";
+                }
+                bool sent = false;
+                series[c][kind].time([&] { sent = call(fd, cbuf, req, payload); });
+                if (!sent) { errors += requests - i; break; }
+            }
+            ::close(fd);
+        });
+    }
+    for (auto& t : threads) t.join();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    long long total = 0;
+    stringstream js;
+    js << "{\"benchmark\":\"billing-daemon\",\"clients\":" << clients << ",\"results\":[\n";
+    for (size_t k = 0; k < 4; ++k) {
+        LatencySeries merged(ops[k]);
+        for (auto& per : series) merged.ns.insert(merged.ns.end(), per[k].ns.begin(), per[k].ns.end());
+        total += (long long)merged.ns.size();
+        js << "  " << merged.json() << (k + 1 < 4 ? ",\n" : "\n");
+    }
+    js << "],\"requests\":" << total << ",\"errors\":" << errors.load() << ",\"seconds\":" << fixed << setprecision(3) << seconds
+       << ",\"throughput_rps\":" << setprecision(0) << (seconds > 0 ? total / seconds : 0) << "}\n";
+    cout << js.str();
+    if (!outPath.empty()) ofstream(outPath.c_str()) << js.str();
+    return errors.load() ? 1 : 0;
+}
+#else
+int run_serve(const CommandOptions&) {
+    cerr << "Daemon mode needs Unix domain sockets and is not available on Windows.\n";
+    return 1;
+}
+
+int run_load(const CommandOptions& opt) { return run_serve(opt); }
+#endif
+
+void pause_screen() {
+    cout << "\nPress ENTER to continue..." << flush;
+    string s;
+    getline(cin, s);
+}
+
+void write_stats_file(const string& path) {
+    if (path.empty()) return;
+#ifndef BILLING_NO_STATS
+    ostringstream out;
+    g_stats.dump(out);
+    if (!write_file_atomic(path, out.str())) cerr << "Could not write statistics to " << path << "\n";
+#endif
+}
+
+void show_stats(const string& statsFile) {
+#ifndef BILLING_NO_STATS
+    g_stats.print(cout);
+    write_stats_file(statsFile);
+    if (!statsFile.empty()) cout << "Statistics written to " << statsFile << "\n";
+#else
+    (void)statsFile;
+    cout << "Statistics are disabled in this build.\n";
+#endif
+}
+
+int main(int argc, char** argv) {
+    string mode = argc > 1 ? argv[1] : "";
+    bool tool = mode == "--generate" || mode == "--bench" || mode == "--pack-invoices" || mode == "--serve" || mode == "--load" || mode == "--import" || mode == "--bill-run";
+    CommandOptions options;
+    if (!options.parse(argc, argv, tool ? 2 : 1)) {
+        cerr << "Usage: " << argv[0] << " [--generate|--bench|--pack-invoices|--serve|--load|--import|--bill-run] [--stats-file PATH] [--compress 0|1] [--option value ...]\n";
+        return 2;
+    }
+    string statsFile = options.get("stats-file", "");
+    if (tool) {
+        int rc = mode == "--generate" ? run_generate(options)
+               : mode == "--bench" ? run_bench(options)
+               : mode == "--serve" ? run_serve(options)
+               : mode == "--load" ? run_load(options)
+               : mode == "--import" ? run_import(options)
+               : mode == "--bill-run" ? run_billing(options)
+               : run_pack_invoices(options);
+        write_stats_file(statsFile);
+        return rc;
+    }
     BillingSystem sys;
+    configure_storage(sys, options);
     while (true) {
         cout << string(60, '=') << "\n";
         cout << "Professional Billing System - Menu\n";
@@ -514,6 +5759,10 @@ int main() {
         cout << "10. List Invoices (meta)\n";
         cout << "11. View Invoice File\n";
         cout << "12. Sales Report (by date range)\n";
+        cout << "13. Compact Data Files\n";
+        cout << "14. Statistics\n";
+        cout << "15. Sales Analytics (grouped)\n";
+        cout << "16. Customer Statement\n";
         cout << "0. Exit\n";
         string opt;
         while (true) {
@@ -524,20 +5773,24 @@ int main() {
             }
             break;
         }
-        if (opt == "1") { sys.add_customer(); pause(); }
-        else if (opt == "2") { sys.list_customers(); pause(); }
-        else if (opt == "3") { sys.search_customers(); pause(); }
-        else if (opt == "4") { sys.remove_customer(); pause(); }
-        else if (opt == "5") { sys.add_item(); pause(); }
-        else if (opt == "6") { sys.list_items(); pause(); }
-        else if (opt == "7") { sys.search_items(); pause(); }
-        else if (opt == "8") { sys.remove_item(); pause(); }
-        else if (opt == "9") { sys.create_invoice(); pause(); }
-        else if (opt == "10") { sys.list_invoices_meta(); pause(); }
-        else if (opt == "11") { sys.view_invoice_file(); pause(); }
-        else if (opt == "12") { sys.export_report_sales(); pause(); }
-        else if (opt == "0") { cout << "Exiting. Goodbye.\n"; break; }
-        else { cout << "Invalid option.\n"; pause(); }
+        if (opt == "1") { sys.add_customer(); pause_screen(); }
+        else if (opt == "2") { sys.list_customers(); pause_screen(); }
+        else if (opt == "3") { sys.search_customers(); pause_screen(); }
+        else if (opt == "4") { sys.remove_customer(); pause_screen(); }
+        else if (opt == "5") { sys.add_item(); pause_screen(); }
+        else if (opt == "6") { sys.list_items(); pause_screen(); }
+        else if (opt == "7") { sys.search_items(); pause_screen(); }
+        else if (opt == "8") { sys.remove_item(); pause_screen(); }
+        else if (opt == "9") { sys.create_invoice(); pause_screen(); }
+        else if (opt == "10") { sys.list_invoices_meta(); pause_screen(); }
+        else if (opt == "11") { sys.view_invoice_file(); pause_screen(); }
+        else if (opt == "12") { sys.export_report_sales(); pause_screen(); }
+        else if (opt == "13") { sys.compact_data_files(); pause_screen(); }
+        else if (opt == "14") { show_stats(statsFile); sys.show_memory(); pause_screen(); }
+        else if (opt == "15") { sys.export_sales_analytics(); pause_screen(); }
+        else if (opt == "16") { sys.show_customer_statement(); pause_screen(); }
+        else if (opt == "0") { sys.shutdown(); write_stats_file(statsFile); cout << "Exiting. Goodbye.\n"; break; }
+        else { cout << "Invalid option.\n"; pause_screen(); }
     }
     return 0;
 }